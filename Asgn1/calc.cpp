@@ -1,18 +1,23 @@
-#define WIN32_LEAN_AND_MEAN
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <windows.h>
+#include "../common/net.h"
 
 #include <cstdint>
 #include <cstring>
 #include <cstdlib>
+#include <cmath>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <string>
 #include <vector>
+#include <map>
 #include <iostream>
-using namespace std;
+#include <chrono>
 
-#pragma comment(lib, "Ws2_32.lib")
+#include "../common/pointop.h"
+#include "../common/stencil.h"
+#include "../common/jobframe.h"
+#include "../common/shmseg.h"
+using namespace std;
 
 // Send all data in buffer
 static int send_all(SOCKET s, const char *buf, int len)
@@ -46,24 +51,36 @@ static int recv_all(SOCKET s, char *buf, int len)
     return 1;
 }
 
-// receive data with 4-byte length
-static bool recv_data(SOCKET s, int32_t &out_msg)
+// one frame header
+static bool recv_frame(SOCKET s, JobFrame &f)
 {
-    uint32_t net_len = 0;
-    if (recv_all(s, (char *)&net_len, sizeof(net_len)) <= 0) return false;
-    out_msg = (int32_t)ntohl(net_len);
+    uint8_t hdr[FRAME_BYTES];
+    if (recv_all(s, (char *)hdr, FRAME_BYTES) <= 0) return false;
+    frame_unpack(hdr, &f);
     return true;
 }
 
+static bool send_frame(SOCKET s, const JobFrame &f)
+{
+    uint8_t hdr[FRAME_BYTES];
+    frame_pack(&f, hdr);
+    return send_all(s, (const char *)hdr, FRAME_BYTES) > 0;
+}
+
 static int row_padded(int width)
 {
     return (width * 3 + 3) & (~3);
 }
 
 // contrast
+static double contrast_gain(int c)
+{
+    return (259.0 * (c + 255.0)) / (255.0 * (259.0 - c));
+}
+
 int adjust(int x, int c)
 {
-    double f = (259.0 * (c + 255.0)) / (255.0 * (259.0 - c));
+    double f = contrast_gain(c);
     int y = (int)(f * (x - 128) + 128);
     if (y < 0)
         y = 0;
@@ -72,31 +89,298 @@ int adjust(int x, int c)
     return y;
 }
 
-int main(int argc, char **argv)
+// Asgn2's 7-tap gaussian across a row, and the same taps down a column: same weights
+// and order as its column pass, so a blur here gives Asgn2's bytes
+struct Gauss7
 {
-    if (argc != 5)
+    static constexpr StencilTap taps[] = {{0, -3}, {0, -2}, {0, -1}, {0, 0}, {0, 1}, {0, 2}, {0, 3}};
+    static constexpr StencilGroup groups[] = {{0.004433, 1}, {0.054005, 1}, {0.242036, 1}, {0.399050, 1},
+                                              {0.242036, 1}, {0.054005, 1}, {0.004433, 1}};
+    static constexpr int renormalize = 1;
+};
+
+struct Gauss7V
+{
+    static constexpr StencilTap taps[] = {{-3, 0}, {-2, 0}, {-1, 0}, {0, 0}, {1, 0}, {2, 0}, {3, 0}};
+    static constexpr StencilGroup groups[] = {{0.004433, 1}, {0.054005, 1}, {0.242036, 1}, {0.399050, 1},
+                                              {0.242036, 1}, {0.054005, 1}, {0.004433, 1}};
+    static constexpr int renormalize = 1;
+};
+
+// Lab3's Reinhard operator on one BGR row; lavg is the whole image's log-average
+static void tonemap_row(uint8_t *p, int width, double key, double lavg)
+{
+    for (int x = 0; x < width; x++, p += 3)
     {
-        printf("Usage: %s <server_ip> <port> <contrast> [id]\n", argv[0]);
-        return 1;
+        double b = p[0] / 255.0;
+        double g = p[1] / 255.0;
+        double r = p[2] / 255.0;
+        double L = (float)(0.2126 * r + 0.7152 * g + 0.0722 * b);
+
+        double Lm = (key / lavg) * L;
+        double Ld = Lm / (1.0 + Lm);
+        double scale = (L > 0) ? (Ld / L) : 0.0;
+
+        p[0] = (uint8_t)fmin(fmax(b * scale * 255.0, 0.0), 255.0);
+        p[1] = (uint8_t)fmin(fmax(g * scale * 255.0, 0.0), 255.0);
+        p[2] = (uint8_t)fmin(fmax(r * scale * 255.0, 0.0), 255.0);
     }
+}
 
-    const char *server_ip = argv[1];
-    int port = atoi(argv[2]);
-    int contrast = atoi(argv[3]);
-    int id = atoi(argv[4]);
+// counts of every byte value per channel, packed as a STATS frame's payload
+static void histogram_pack(const uint8_t *data, int rows, int width, int padded, uint8_t *out)
+{
+    std::vector<uint32_t> hist(3 * 256, 0);
+    for (int y = 0; y < rows; y++)
+    {
+        const uint8_t *p = data + (size_t)y * padded;
+        for (int x = 0; x < width; x++, p += 3)
+        {
+            hist[p[0]]++;
+            hist[256 + p[1]]++;
+            hist[512 + p[2]]++;
+        }
+    }
+    for (int i = 0; i < 3 * 256; i++)
+    {
+        frame_put(out + 4 * i, hist[(size_t)i]);
+    }
+}
 
-    // Server setup
-    WSADATA w;
-    if (WSAStartup(MAKEWORD(2, 2), &w)){
-        printf("WSAstartup failed");
+// the ops this worker runs, announced in HELLO
+#define CALC_OPS                                                                                                  \
+    ((1u << OP_CONTRAST) | (1u << OP_BALANCE) | (1u << OP_BLUR) | (1u << OP_TONEMAP) | (1u << OP_HISTOGRAM) | \
+     (1u << OP_STRETCH))
+
+// the job in progress: op, its prepared state, and the rows it runs over
+struct Kernel
+{
+    uint32_t op;
+    int32_t param[FRAME_PARAMS];
+    int pass;         // OP_BLUR: 0 across (buf -> tmp), 1 down (tmp -> buf)
+    PointOp table;    // OP_CONTRAST, OP_BALANCE
+    double key, lavg; // OP_TONEMAP
+    uint8_t *buf, *tmp;
+    int rows, width, padded; // rows in buf, halo included
+};
+
+// point ops only depend on op + params: the table is rebuilt only when a job brings
+// new ones (contrast is also evaluated as a fixed-point line when it fits)
+static int kernel_setup(Kernel *k, const JobFrame &job)
+{
+    int same = k->op == job.op && memcmp(k->param, job.param, sizeof(k->param)) == 0;
+    k->op = job.op;
+    memcpy(k->param, job.param, sizeof(k->param));
+    switch (job.op)
+    {
+    case OP_CONTRAST:
+        if (!same)
+        {
+            int contrast = job.param[0];
+            pointop_identity(&k->table);
+            pointop_map(&k->table, POINTOP_ALL, [&](int x) { return adjust(x, contrast); });
+            double f = contrast_gain(contrast);
+            pointop_linear(&k->table, f, 128.0 - 128.0 * f);
+        }
+        return 1;
+    case OP_BALANCE:
+        if (!same)
+        {
+            pointop_identity(&k->table);
+            for (int ch = 0; ch < 3; ch++)
+            {
+                long long gain = job.param[ch];
+                pointop_map(&k->table, ch, [&](int x) { return (int)((x * gain + 32768) >> 16); });
+            }
+        }
+        return 1;
+    case OP_BLUR:
+        return job.param[0] > 0;
+    case OP_STRETCH:
+        if (job.param[0] < 0 || job.param[1] <= job.param[0] || job.param[1] > 255)
+        {
+            break;
+        }
+        if (!same)
+        {
+            double gain = 255.0 / (job.param[1] - job.param[0]);
+            double offset = -job.param[0] * gain;
+            pointop_identity(&k->table);
+            pointop_map(&k->table, POINTOP_ALL, [&](int x) { return (int)floor(gain * x + offset); });
+            pointop_linear(&k->table, gain, offset);
+        }
         return 1;
+    case OP_TONEMAP:
+        k->key = frame_get_double(job.param);
+        k->lavg = frame_get_double(job.param + 2);
+        return k->lavg > 0.0;
+    case OP_HISTOGRAM:
+        return 1; // counted in the job loop, no kernel
+    }
+    k->op = 0;
+    return 0;
+}
+
+// rows [r0, r0 + n) of the job
+static void kernel_rows(const Kernel *k, int r0, int n)
+{
+    uint8_t *row = k->buf + (size_t)r0 * k->padded;
+    if (k->op == OP_BLUR)
+    {
+        for (int y = r0; y < r0 + n; y++)
+        {
+            size_t off = (size_t)y * k->padded;
+            if (k->pass == 0)
+            {
+                stencil_row<Gauss7>(k->buf + off, k->padded, k->tmp + off, 0, k->width, 1);
+            }
+            else
+            {
+                stencil_row<Gauss7V>(k->tmp, k->padded, k->buf + off, y, k->width, k->rows);
+            }
+        }
+    }
+    else if (k->op == OP_TONEMAP)
+    {
+        for (int y = 0; y < n; y++)
+        {
+            tonemap_row(row + (size_t)y * k->padded, k->width, k->key, k->lavg);
+        }
+    }
+    else
+    {
+        pointop_apply(&k->table, row, n, k->width, k->padded);
+    }
+}
+
+// A job's rows are cut into blocks of about CREW_BLOCK_BYTES. The thread reading the
+// socket publishes how many rows are in; the helper threads take the next block that
+// has arrived, so rows are processed while the rest of the slab is still on the
+// wire. Without helpers the reader does each block itself as soon as it is in.
+#define CREW_BLOCK_BYTES 65536
+
+struct Crew
+{
+    std::vector<std::thread> helpers;
+    std::mutex m;
+    std::condition_variable wake; // helpers: rows arrived (or quit)
+    std::condition_variable done; // reader: the last block finished
+    int quit;
+    // the job in progress
+    const Kernel *k;
+    int rows, block;
+    int arrived;  // rows in the buffer
+    int claimed;  // rows taken by a thread
+    int finished; // rows processed
+};
+
+// take blocks that have arrived until there are none; called with the lock held
+static void crew_work(Crew *c, std::unique_lock<std::mutex> &lock)
+{
+    while (c->claimed < c->arrived)
+    {
+        int r0 = c->claimed;
+        int n = (c->arrived - r0 < c->block) ? c->arrived - r0 : c->block;
+        c->claimed += n;
+        lock.unlock();
+        kernel_rows(c->k, r0, n);
+        lock.lock();
+        c->finished += n;
+        if (c->finished == c->rows)
+        {
+            c->done.notify_one();
+        }
+    }
+}
+
+static void crew_helper(Crew *c)
+{
+    std::unique_lock<std::mutex> lock(c->m);
+    while (!c->quit)
+    {
+        crew_work(c, lock);
+        c->wake.wait(lock, [c] { return c->quit || c->claimed < c->arrived; });
+    }
+}
+
+static void crew_start(Crew *c, int threads)
+{
+    c->quit = 0;
+    c->rows = c->arrived = c->claimed = c->finished = 0;
+    for (int t = 1; t < threads; t++)
+    {
+        c->helpers.push_back(std::thread(crew_helper, c));
+    }
+}
+
+static void crew_stop(Crew *c)
+{
+    {
+        std::lock_guard<std::mutex> lock(c->m);
+        c->quit = 1;
+    }
+    c->wake.notify_all();
+    for (std::thread &t : c->helpers)
+    {
+        t.join();
+    }
+}
+
+static void crew_begin(Crew *c, const Kernel *k)
+{
+    std::lock_guard<std::mutex> lock(c->m);
+    c->k = k;
+    c->rows = k->rows;
+    c->block = (k->padded > 0 && CREW_BLOCK_BYTES / k->padded > 1) ? CREW_BLOCK_BYTES / k->padded : 1;
+    c->arrived = c->claimed = c->finished = 0;
+}
+
+// rows [0, rows_in) are in the buffer
+static void crew_arrived(Crew *c, int rows_in)
+{
+    std::unique_lock<std::mutex> lock(c->m);
+    c->arrived = rows_in;
+    if (c->helpers.empty())
+    {
+        crew_work(c, lock);
+        return;
     }
+    lock.unlock();
+    c->wake.notify_all();
+}
+
+// everything is in: help with what is left, then wait for the last block
+static void crew_finish(Crew *c)
+{
+    std::unique_lock<std::mutex> lock(c->m);
+    crew_work(c, lock);
+    c->done.wait(lock, [c] { return c->finished == c->rows; });
+}
+
+// all of k's rows are already in
+static void crew_run(Crew *c, const Kernel *k)
+{
+    crew_begin(c, k);
+    crew_arrived(c, k->rows);
+    crew_finish(c);
+}
 
+// simulated noisy box: --slow sleeps this long per row after every job
+static void linger(int slow_us, int rows)
+{
+    if (slow_us > 0)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds((long long)slow_us * rows));
+    }
+}
+
+// connect to the coordinator's port
+static SOCKET dial(const char *server_ip, int port, int id)
+{
     SOCKET s= socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (s== INVALID_SOCKET){
         printf("Socket failed");
-        WSACleanup();
-        return 1;
+        return INVALID_SOCKET;
     }
     
     struct sockaddr_in addr = {0};
@@ -104,63 +388,305 @@ int main(int argc, char **argv)
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
     addr.sin_port = htons(port);
 
-    int32_t rows = 0;
-    int32_t width = 0;
-
     if (inet_pton(AF_INET, server_ip, &addr.sin_addr) != 1)
     {
         printf("id=%d bad IPv4: %s\n", id, server_ip);
         closesocket(s);
-        WSACleanup();
-        return 1;
+        return INVALID_SOCKET;
     }
 
     if (connect(s, (sockaddr *)&addr, sizeof(addr)) != 0)
     {
         printf("id=%d connect failed\n", id);
         closesocket(s);
-        WSACleanup();
+        return INVALID_SOCKET;
+    }
+
+    net_set_nodelay(s);
+    return s;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        printf("Usage: %s <server_ip> <port> <id> [--shm name] [--slow us_per_row] [--threads n]\n", argv[0]);
+        printf("       %s --fd <fd> <id> [...]   (started by spawn on POSIX, fd already connected)\n", argv[0]);
         return 1;
     }
 
-    if (!recv_data(s, rows) || !recv_data(s, width))
+    const char *server_ip = argv[1];
+    int port = atoi(argv[2]);
+    int id = atoi(argv[3]);
+    int fd = (strcmp(argv[1], "--fd") == 0) ? atoi(argv[2]) : -1;
+    const char *shm_name = NULL;
+    int slow_us = 0; // simulated noisy box: extra sleep per row
+    int threads = 1;
+    for (int i = 4; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "--shm") == 0)
+        {
+            shm_name = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "--slow") == 0)
+        {
+            slow_us = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--threads") == 0)
+        {
+            threads = atoi(argv[i + 1]);
+            threads = (threads < 1) ? 1 : threads;
+        }
+    }
+
+    // a local worker works on the coordinator's image in place
+    int have_shm = 0;
+#ifndef _WIN32
+    ShmSegment seg;
+    if (shm_name)
+    {
+        have_shm = shmseg_open(&seg, shm_name);
+        if (!have_shm)
+        {
+            printf("id=%d can't open %s, rows go over the socket\n", id, shm_name);
+        }
+    }
+#endif
+
+    // Server setup
+    WSADATA w;
+    if (WSAStartup(MAKEWORD(2, 2), &w)){
+        printf("WSAstartup failed");
+        return 1;
+    }
+
+    // spawned with --fd: the coordinator's socketpair is already connected
+    SOCKET s = (fd >= 0) ? (SOCKET)fd : dial(server_ip, port, id);
+    if (s == INVALID_SOCKET)
     {
-        printf("id=%d recv header failed\n", id);
-        closesocket(s);
         WSACleanup();
         return 1;
     }
-    
-    int padded = row_padded((int)width);
-    int bytes = (int)rows * padded;
-    std::vector<uint8_t> bgr((size_t)bytes);
 
-    if (bytes > 0 && recv_all(s, (char *)bgr.data(), bytes) <= 0)
+    // register once with the ops this worker runs, then serve jobs until QUIT (or
+    // the coordinator goes away)
+    JobFrame hello = frame_make(FRAME_HELLO, (uint32_t)id);
+    hello.param[0] = (int32_t)CALC_OPS;
+    hello.param[1] = have_shm;
+    if (!send_frame(s, hello))
     {
-        printf("id=%d recv chunk failed\n", id);
+        printf("id=%d hello failed\n", id);
         closesocket(s);
         WSACleanup();
         return 1;
     }
 
-    int pixel_bytes = (int)width * 3;
-    for (int i = 0; i < rows; i++)
+    Crew crew;
+    crew_start(&crew, threads);
+
+    Kernel k;
+    memset(&k, 0, sizeof(k));
+    std::vector<uint8_t> bgr, tmp;
+    std::vector<uint8_t> stats(FRAME_HIST_BYTES);
+
+    // rows of histogram jobs over the socket, by job id, for the APPLY after the
+    // merge; all of them belong to the image tagged held_tag
+    std::map<uint32_t, std::vector<uint8_t>> held;
+    int32_t held_tag = -1;
+
+    JobFrame job;
+    while (recv_frame(s, job) && (job.type == FRAME_JOB || job.type == FRAME_SHM_JOB || job.type == FRAME_APPLY))
     {
-        uint8_t *row = bgr.data() + (size_t)i * (size_t)padded;
-        for (int j = 0; j < pixel_bytes; j++)
+        if (job.version != FRAME_VERSION)
         {
-            row[j] = (uint8_t)adjust((int)row[j], contrast);
+            printf("id=%d protocol version %u, expected %u\n", id, job.version, FRAME_VERSION);
+            break;
+        }
+        if (!kernel_setup(&k, job))
+        {
+            printf("id=%d can't run op %u\n", id, job.op);
+            break;
+        }
+
+        int rows = (int)job.rows;
+        int top = (int)job.halo_top;
+        int total = top + rows + (int)job.halo_bottom;
+        int width = (int)job.width;
+        int padded = row_padded(width);
+        int bytes = rows * padded;
+        k.width = width;
+        k.padded = padded;
+        k.pass = 0;
+
+        JobFrame reply = job;
+        reply.halo_top = reply.halo_bottom = 0;
+
+        // phase one of auto contrast: count, keep the rows, send the counts back
+        if (job.op == OP_HISTOGRAM)
+        {
+            if (job.param[0] != held_tag)
+            {
+                held.clear(); // a new image: nobody will APPLY to the old rows
+                held_tag = job.param[0];
+            }
+            const uint8_t *counted = NULL;
+#ifndef _WIN32
+            if (job.type == FRAME_SHM_JOB)
+            {
+                size_t off = (size_t)job.start_row * padded;
+                if (!have_shm || !shmseg_map(&seg, off + bytes))
+                {
+                    printf("id=%d shared image not mapped\n", id);
+                    break;
+                }
+                counted = seg.base + off;
+            }
+#endif
+            if (job.type == FRAME_JOB && total == rows)
+            {
+                std::vector<uint8_t> &keep = held[job.job];
+                keep.resize((size_t)bytes);
+                if (bytes > 0 && recv_all(s, (char *)keep.data(), bytes) <= 0)
+                {
+                    printf("id=%d recv chunk failed\n", id);
+                    break;
+                }
+                counted = keep.data();
+            }
+            if (!counted)
+            {
+                printf("id=%d bad histogram job\n", id);
+                break;
+            }
+            histogram_pack(counted, rows, width, padded, stats.data());
+            linger(slow_us, rows);
+            reply.type = FRAME_STATS;
+            if (!send_frame(s, reply) || send_all(s, (const char *)stats.data(), FRAME_HIST_BYTES) <= 0)
+            {
+                printf("id=%d send result failed\n", id);
+                break;
+            }
+            continue;
+        }
+
+        // phase two: the rows are already here
+        if (job.type == FRAME_APPLY)
+        {
+            auto it = held.find(job.job);
+            if (it == held.end() || it->second.size() != (size_t)bytes)
+            {
+                printf("id=%d no rows kept for job %u\n", id, job.job);
+                break;
+            }
+            k.buf = it->second.data();
+            k.rows = rows;
+            crew_run(&crew, &k);
+            linger(slow_us, rows);
+            reply.type = FRAME_RESULT;
+            if (!send_frame(s, reply) || (bytes > 0 && send_all(s, (const char *)it->second.data(), bytes) <= 0))
+            {
+                printf("id=%d send result failed\n", id);
+                break;
+            }
+            held.erase(it);
+            continue;
+        }
+
+#ifndef _WIN32
+        if (job.type == FRAME_SHM_JOB)
+        {
+            size_t off = (size_t)job.start_row * padded;
+            if (!have_shm || !shmseg_map(&seg, off + bytes))
+            {
+                printf("id=%d shared image not mapped\n", id);
+                break;
+            }
+            if (frame_op_halo(job.op, job.param) > 0)
+            {
+                printf("id=%d op %u reads past its rows, not run in place\n", id, job.op);
+                break;
+            }
+            k.buf = seg.base + off;
+            k.rows = rows;
+            crew_run(&crew, &k);
+            linger(slow_us, rows);
+            reply.type = FRAME_SHM_DONE;
+            if (!send_frame(s, reply))
+            {
+                printf("id=%d send result failed\n", id);
+                break;
+            }
+            continue;
+        }
+#endif
+
+        size_t need = (size_t)total * padded;
+        if (need > bgr.size())
+        {
+            bgr.resize(need);
+        }
+        if (job.op == OP_BLUR && need > tmp.size())
+        {
+            tmp.resize(need);
+        }
+        k.buf = bgr.data();
+        k.tmp = tmp.data();
+        k.rows = total;
+
+        // one block at a time, each handed over as soon as it is in (the blur's
+        // first pass across the rows too)
+        crew_begin(&crew, &k);
+        int in = 0;
+        while (in < total)
+        {
+            int n = (total - in < crew.block) ? total - in : crew.block;
+            if (recv_all(s, (char *)bgr.data() + (size_t)in * padded, n * padded) <= 0)
+            {
+                break;
+            }
+            in += n;
+            crew_arrived(&crew, in);
+        }
+        if (in < total)
+        {
+            printf("id=%d recv chunk failed\n", id);
+            break;
+        }
+        crew_finish(&crew);
+
+        // the passes down need the rows above and below: one crew run each over the
+        // whole buffer, halo included, so the next pass still has its neighbours
+        if (job.op == OP_BLUR)
+        {
+            for (int p = 0; p < job.param[0]; p++)
+            {
+                if (p > 0)
+                {
+                    k.pass = 0;
+                    crew_run(&crew, &k);
+                }
+                k.pass = 1;
+                crew_run(&crew, &k);
+            }
+        }
+        linger(slow_us, rows);
+
+        reply.type = FRAME_RESULT;
+        if (!send_frame(s, reply) ||
+            (bytes > 0 && send_all(s, (const char *)bgr.data() + (size_t)top * padded, bytes) <= 0))
+        {
+            printf("id=%d send result failed\n", id);
+            break;
         }
     }
 
-    if (bytes > 0 && send_all(s, (const char *)bgr.data(), bytes) <= 0)
+    crew_stop(&crew);
+#ifndef _WIN32
+    if (have_shm)
     {
-        printf("id=%d send result failed\n", id);
-        closesocket(s);
-        WSACleanup();
-        return 1;
+        shmseg_close(&seg);
     }
-
+#endif
     closesocket(s);
     WSACleanup();
     return 0;
@@ -1,19 +1,29 @@
-#define WIN32_LEAN_AND_MEAN
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <windows.h>
+#include "../common/net.h"
+#include "../common/jobframe.h"
+#include "../common/shmseg.h"
+#include "../common/hash64.h"
+#include "../common/resultcache.h"
 
 #include <cstdint>
 #include <cstring>
 #include <cstdlib>
+#include <cmath>
 #include <thread>
 #include <string>
 #include <vector>
 #include <iostream>
 #include <atomic>
-using namespace std;
+#include <chrono>
+#include <deque>
+#include <algorithm>
 
-#pragma comment(lib, "Ws2_32.lib")
+#ifndef _WIN32
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+extern char **environ;
+#endif
+using namespace std;
 
 #pragma pack(push, 1)
 struct BMPFileHeader
@@ -71,11 +81,20 @@ static int recv_all(SOCKET s, char *buf, int len)
     return 1;
 }
 
-// send data with 4-byte length
-static bool send_data(SOCKET s, int32_t v)
+// one frame header
+static bool send_frame(SOCKET s, const JobFrame &f)
+{
+    uint8_t hdr[FRAME_BYTES];
+    frame_pack(&f, hdr);
+    return send_all(s, (const char *)hdr, FRAME_BYTES) > 0;
+}
+
+static bool recv_frame(SOCKET s, JobFrame &f)
 {
-    uint32_t net = htonl((uint32_t)v);
-    return (send_all(s, (const char *)&net, (int)sizeof(net)) > 0);
+    uint8_t hdr[FRAME_BYTES];
+    if (recv_all(s, (char *)hdr, FRAME_BYTES) <= 0) return false;
+    frame_unpack(hdr, &f);
+    return true;
 }
 
 static int row_padded(int width)
@@ -89,9 +108,32 @@ struct BMPImage24
     int height = 0;
     int pre_height = 0;
     std::vector<uint8_t> bgr; // BGR data
+    uint8_t *pixels = NULL;   // bgr.data(), or the shared segment
+};
+
+// where the pixels of the run's images live: img.bgr, or (POSIX, local workers)
+// a shared segment the workers map, so rows never go through a socket
+struct ImageStore
+{
+    int shared = 0;
+#ifndef _WIN32
+    ShmSegment seg;
+#endif
 };
 
-static BMPImage24 load_bmp(const char *filename)
+static uint8_t *store_reserve(ImageStore *store, BMPImage24 *img, size_t bytes)
+{
+#ifndef _WIN32
+    if (store->shared)
+    {
+        return shmseg_reserve(&store->seg, bytes) ? store->seg.base : NULL;
+    }
+#endif
+    img->bgr.resize(bytes);
+    return img->bgr.data();
+}
+
+static BMPImage24 load_bmp(const char *filename, ImageStore *store)
 {
     FILE *file = fopen(filename, "rb");
     if (!file)
@@ -127,7 +169,13 @@ static BMPImage24 load_bmp(const char *filename)
 
     int padding = row_padded(img.width);
     int image_bytes = padding * img.height;
-    img.bgr.resize((size_t)image_bytes);
+    img.pixels = store_reserve(store, &img, (size_t)image_bytes);
+    if (!img.pixels)
+    {
+        printf("Can't allocate %d bytes for the image\n", image_bytes);
+        fclose(file);
+        exit(EXIT_FAILURE);
+    }
 
     if (fseek(file, fh.bfOffBits, SEEK_SET) != 0)
     {
@@ -136,7 +184,7 @@ static BMPImage24 load_bmp(const char *filename)
         exit(EXIT_FAILURE);
     }
 
-    if (fread(img.bgr.data(), 1, image_bytes, file) != image_bytes)
+    if (fread(img.pixels, 1, image_bytes, file) != (size_t)image_bytes)
     {
         printf("Can't read pixel data\n");
         fclose(file);
@@ -182,48 +230,828 @@ static void save_bmp(const char *filename, const BMPImage24 *img)
 
     fwrite(&fh, sizeof(fh), 1, file);
     fwrite(&ih, sizeof(ih), 1, file);
-    fwrite(img->bgr.data(), 1, img->bgr.size(), file);
+    fwrite(img->pixels, 1, (size_t)padding * height, file);
     fclose(file);
 }
 
+
 static const char *IP = "127.0.0.1";
 static const int PORT = 5000;
 
-int main(int argc, char **argv)
+static double seconds_since(chrono::steady_clock::time_point t0)
 {
-    // ./spawn calc 10 input.bmp output.bmp
-    if (argc != 5)
+    return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+// a kernel and its params, as a job frame carries them
+struct OpSpec
+{
+    uint32_t op; // OP_*
+    int32_t param[FRAME_PARAMS];
+};
+
+static const char *op_name(uint32_t op)
+{
+    switch (op)
+    {
+    case OP_CONTRAST:
+        return "contrast";
+    case OP_BALANCE:
+        return "balance";
+    case OP_BLUR:
+        return "blur";
+    case OP_TONEMAP:
+        return "tonemap";
+    case OP_HISTOGRAM:
+        return "histogram";
+    case OP_STRETCH:
+        return "stretch";
+    }
+    return "?";
+}
+
+// "contrast[:c]", "balance[:b,g,r]", "blur[:passes]", "tonemap[:key]",
+// "stretch:lo,hi" or "autocontrast[:clip%]"; 0 if it isn't one of those. Without a
+// value: contrast -50, Lab5's gains (0.9, 0.8, 1.0), one blur pass, Lab3's key 0.18,
+// 0.5% clipped at each end. Auto contrast is a stretch whose lo / hi (-1 here) come
+// from the image's histogram, see run_image.
+static int parse_op(const char *spec, OpSpec *op)
+{
+    memset(op, 0, sizeof(*op));
+    const char *arg = strchr(spec, ':');
+    string name = arg ? string(spec, (size_t)(arg - spec)) : string(spec);
+    arg = arg ? arg + 1 : NULL;
+    if (name == "contrast")
+    {
+        op->op = OP_CONTRAST;
+        op->param[0] = arg ? atoi(arg) : -50;
+        return op->param[0] >= -255 && op->param[0] <= 255;
+    }
+    if (name == "balance")
     {
-        printf("Usage: ./spawn <worker_exe> <num_workers> <input.bmp> <output.bmp>\n");
+        double gain[3] = {0.9, 0.8, 1.0};
+        if (arg && sscanf(arg, "%lf,%lf,%lf", &gain[0], &gain[1], &gain[2]) != 3)
+        {
+            return 0;
+        }
+        op->op = OP_BALANCE;
+        for (int c = 0; c < 3; c++)
+        {
+            if (gain[c] < 0.0 || gain[c] > 255.0)
+            {
+                return 0;
+            }
+            op->param[c] = (int32_t)(gain[c] * 65536.0 + 0.5);
+        }
         return 1;
     }
+    if (name == "blur")
+    {
+        op->op = OP_BLUR;
+        op->param[0] = arg ? atoi(arg) : 1;
+        return op->param[0] > 0;
+    }
+    if (name == "stretch")
+    {
+        op->op = OP_STRETCH;
+        return arg && sscanf(arg, "%d,%d", &op->param[0], &op->param[1]) == 2 && op->param[0] >= 0 &&
+               op->param[0] < op->param[1] && op->param[1] <= 255;
+    }
+    if (name == "autocontrast")
+    {
+        double clip = arg ? atof(arg) : 0.5;
+        op->op = OP_STRETCH;
+        op->param[0] = op->param[1] = -1;
+        op->param[2] = (int32_t)(clip * 100.0 + 0.5); // in 1/10000
+        return clip >= 0.0 && clip < 50.0;
+    }
+    if (name == "tonemap")
+    {
+        double key = arg ? atof(arg) : 0.18;
+        op->op = OP_TONEMAP;
+        frame_put_double(op->param, key);
+        return key > 0.0;
+    }
+    return 0;
+}
 
-    const char *worker_path = argv[1];
-    int num_workers = atoi(argv[2]);
-    const char *input_bmp = argv[3];
-    const char *output_bmp = argv[4];
+// Reinhard's log-average luminance of the whole image (Lab3's stage 1); tone map
+// jobs carry it, since no worker sees more than its rows
+static double log_average(const BMPImage24 *img)
+{
+    const int padding = row_padded(img->width);
+    double sum = 0.0;
+    for (int y = 0; y < img->height; y++)
+    {
+        const uint8_t *p = img->pixels + (size_t)y * padding;
+        for (int x = 0; x < img->width; x++, p += 3)
+        {
+            double L = 0.2126 * (p[2] / 255.0) + 0.7152 * (p[1] / 255.0) + 0.0722 * (p[0] / 255.0);
+            sum += log(L + 1.0);
+        }
+    }
+    double n = (double)img->width * img->height;
+    return (n > 0) ? exp(sum / n) - 1.0 : 0.0;
+}
 
-    const char *server_ip = IP;
-    int port = PORT;
-    int contrast = -50; // constrast value - change as needed
+struct ChunkPlan
+{
+    int dynamic;   // 0: one chunk per worker
+    int inflight;  // per lane
+    int speculate; // idle lanes take backup copies of outstanding chunks at the end
+    int width;
+    int height;
+    int padding;
+    OpSpec op;
+    int halo;     // rows the op reads above / below a chunk
+    int affinity; // chunks go first to the lane holding their rows (APPLY frames)
+};
 
-    BMPImage24 img = load_bmp(input_bmp);
-    const int padding = row_padded(img.width);
+struct Lane;
 
-    // Server setup
-    WSADATA w;
-    WSAStartup(MAKEWORD(2, 2), &w);
+// one attempt at a chunk on one worker: JOB frame + rows out (with the op's halo),
+// RESULT frame + rows back. A worker on the shared image only gets SHM_JOB /
+// SHM_DONE frames and works on the image in place: no payload either way.
+struct Slab
+{
+    SOCKET s;
+    Lane *lane;
+    uint32_t job;
+    int chunk;  // which piece of the image
+    int backup; // a speculative copy of a chunk still out elsewhere
+    int shm;
+    uint32_t reply; // frame type that answers it
+    int start_row;
+    int rows;
+    int top;                  // halo rows sent above start_row
+    int bytes;                // rows * padding
+    int send_bytes;           // row bytes out: halo included, 0 for shm
+    int recv_bytes;           // bytes back: the rows, counts for a histogram, 0 for shm
+    const uint8_t *src;       // rows to send, from start_row - top
+    uint8_t *dst;             // where the result rows go
+    uint8_t hdr[FRAME_BYTES]; // JOB frame
+    uint8_t res[FRAME_BYTES]; // RESULT frame as it arrives
+    int sent;                 // of FRAME_BYTES + send_bytes
+    int received;             // of FRAME_BYTES + recv_bytes
+};
+
+// the halo rows around a chunk, which stop at the image edges
+static void chunk_halo(const ChunkPlan *plan, int start_row, int rows, int *top, int *bottom)
+{
+    int below = plan->height - (start_row + rows);
+    *top = (start_row < plan->halo) ? start_row : plan->halo;
+    *bottom = (below < plan->halo) ? below : plan->halo;
+}
+
+// apply: an APPLY frame on the rows the worker kept from histogram job `job`
+static void slab_setup(Slab *sl, SOCKET s, int shm, int apply, uint32_t job, int start_row, int rows, const ChunkPlan *plan)
+{
+    int top, bottom;
+    chunk_halo(plan, start_row, rows, &top, &bottom);
+
+    int counts = plan->op.op == OP_HISTOGRAM;
+    sl->s = s;
+    sl->lane = NULL;
+    sl->job = job;
+    sl->chunk = 0;
+    sl->backup = 0;
+    sl->shm = shm;
+    sl->reply = counts ? FRAME_STATS : shm ? FRAME_SHM_DONE : FRAME_RESULT;
+    sl->start_row = start_row;
+    sl->rows = rows;
+    sl->top = top;
+    sl->bytes = rows * plan->padding;
+    sl->send_bytes = (shm || apply) ? 0 : (top + rows + bottom) * plan->padding;
+    sl->recv_bytes = counts ? FRAME_HIST_BYTES : shm ? 0 : sl->bytes;
+    sl->src = NULL;
+    sl->dst = NULL;
+    JobFrame f = frame_make(apply ? FRAME_APPLY : shm ? FRAME_SHM_JOB : FRAME_JOB, job);
+    f.op = plan->op.op;
+    memcpy(f.param, plan->op.param, sizeof(f.param));
+    f.rows = (uint32_t)rows;
+    f.width = (uint32_t)plan->width;
+    f.start_row = (uint32_t)start_row;
+    f.halo_top = (uint32_t)top;
+    f.halo_bottom = (uint32_t)bottom;
+    frame_pack(&f, sl->hdr);
+    sl->sent = 0;
+    sl->received = 0;
+}
+
+// the RESULT header answers this slab's JOB
+static int slab_result_ok(const Slab *sl)
+{
+    JobFrame f;
+    frame_unpack(sl->res, &f);
+    return f.version == FRAME_VERSION && f.type == sl->reply && f.job == sl->job && (int)f.rows == sl->rows;
+}
+
+// push frame + rows until the socket buffer is full; 0 on error
+static int slab_send(Slab *sl)
+{
+    while (sl->sent < FRAME_BYTES + sl->send_bytes)
+    {
+        const char *p;
+        int len;
+        if (sl->sent < FRAME_BYTES)
+        {
+            p = (const char *)sl->hdr + sl->sent;
+            len = FRAME_BYTES - sl->sent;
+        }
+        else
+        {
+            int off = sl->sent - FRAME_BYTES;
+            p = (const char *)sl->src + off;
+            len = sl->send_bytes - off;
+        }
+        int n = send(sl->s, p, len, 0);
+        if (n <= 0)
+        {
+            return n < 0 && net_would_block();
+        }
+        sl->sent += n;
+    }
+    return 1;
+}
+
+// take whatever result bytes are there, the rows straight to sl->dst; 0 on error
+static int slab_recv(Slab *sl)
+{
+    while (sl->received < FRAME_BYTES + sl->recv_bytes)
+    {
+        char *p;
+        int len;
+        if (sl->received < FRAME_BYTES)
+        {
+            p = (char *)sl->res + sl->received;
+            len = FRAME_BYTES - sl->received;
+        }
+        else
+        {
+            int off = sl->received - FRAME_BYTES;
+            p = (char *)sl->dst + off;
+            len = sl->recv_bytes - off;
+        }
+        int n = recv(sl->s, p, len, 0);
+        if (n == 0)
+        {
+            return 0; // worker closed early
+        }
+        if (n < 0)
+        {
+            return net_would_block();
+        }
+        sl->received += n;
+        if (sl->received == FRAME_BYTES && !slab_result_ok(sl))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int slab_sent(const Slab *sl)
+{
+    return sl->sent == FRAME_BYTES + sl->send_bytes;
+}
+
+static int slab_done(const Slab *sl)
+{
+    return slab_sent(sl) && sl->received == FRAME_BYTES + sl->recv_bytes;
+}
+
+// a worker connection with up to `inflight` chunks queued on it. The worker answers
+// in order, so results are read for the oldest chunk first.
+struct Lane
+{
+    SOCKET s;         // INVALID_SOCKET once the worker died or hung
+    uint32_t ops;     // mask of the OP_* its worker registered
+    int shm;
+    deque<int> queue; // attempts in flight, oldest first
+    size_t sending;   // queue[sending] is being written; queue.size() = all sent
+    int out;          // NET_OUT is being polled for
+    int chunks;       // handed out over the run
+    double bytes;     // image bytes answered over the run
+    double idle;      // s with nothing in flight while an image was running
+    chrono::steady_clock::time_point idle_since;
+#ifndef _WIN32
+    pid_t pid; // spawned here: killed when dropped, it may still write the shared image
+#endif
+};
+
+// a piece of the image and what became of it. Only the first attempt may work on
+// the shared image in place; once one has, later attempts get the original rows
+// from the snapshot and answer into `spare`, so nobody processes rows twice while a
+// straggler is still at it.
+struct Chunk
+{
+    int start_row;
+    int rows;
+    int done;
+    int live;       // attempts in flight on workers still up
+    int attempts;   // handed out so far
+    int in_place;   // a shared-image attempt was handed out
+    int from_spare; // the result that counted is in spare, not in the image
+    vector<uint8_t> spare;
+    vector<uint8_t> stats; // histogram job: the counts as they came in
+    Lane *holder;          // the lane whose answer counted (it may keep the rows)
+    uint32_t held_job;     // and the job it answered
+    int held_used;         // an APPLY to the holder was handed out
+    uint64_t key;          // result cache: rows sent + op
+    int cached;            // answered from the cache, never handed out
+};
+
+// one image in flight over the pool
+struct Dispatch
+{
+    vector<Chunk> chunks;
+    vector<Slab> attempts;
+    deque<int> retry; // chunks whose only worker died, handed out first
+    size_t next;      // dynamic: first chunk never handed out
+    size_t done;
+    const uint8_t *source; // the image as loaded: what gets sent
+    uint8_t *image;        // where results go
+    uint32_t *next_job;
+    int backups;
+    int backup_wins;
+    int reassigned;
+    int duplicates; // results for chunks some other worker had already answered
+};
+
+// queue an attempt at chunk c on the lane
+static void lane_give(Lane *ln, Dispatch *d, int c, int backup, const ChunkPlan *plan)
+{
+    Chunk *ch = &d->chunks[(size_t)c];
+    size_t off = (size_t)ch->start_row * (size_t)plan->padding;
+    int shm = ln->shm && ch->attempts == 0 && plan->halo == 0;
+    int apply = !shm && plan->affinity && ch->holder == ln && !ch->held_used;
+    Slab sl;
+    slab_setup(&sl, ln->s, shm, apply, apply ? ch->held_job : (*d->next_job)++, ch->start_row, ch->rows, plan);
+    sl.lane = ln;
+    sl.chunk = c;
+    sl.backup = backup;
+    sl.src = d->source + off - (size_t)sl.top * (size_t)plan->padding;
+    sl.dst = d->image + off;
+    if (plan->op.op == OP_HISTOGRAM)
+    {
+        ch->stats.resize(FRAME_HIST_BYTES); // every attempt counts the same rows
+        sl.dst = ch->stats.data();
+    }
+    else if (ch->in_place)
+    {
+        ch->spare.resize((size_t)sl.bytes);
+        sl.dst = ch->spare.data();
+    }
+    ch->in_place |= sl.shm && plan->op.op != OP_HISTOGRAM;
+    ch->held_used |= apply;
+    ch->attempts++;
+    ch->live++;
+    d->attempts.push_back(sl);
+    ln->queue.push_back((int)d->attempts.size() - 1);
+    ln->chunks++;
+}
+
+// top the lane up to `inflight`: reassigned chunks first, then (dynamic) unassigned
+// ones. With nothing left to hand out, an idle lane takes a backup copy of the
+// oldest chunk still out on a single worker; whichever answer comes first counts.
+static void lane_fill(Lane *ln, Dispatch *d, const ChunkPlan *plan)
+{
+    while ((int)ln->queue.size() < plan->inflight)
+    {
+        if (!d->retry.empty())
+        {
+            int c = d->retry.front();
+            d->retry.pop_front();
+            if (!d->chunks[(size_t)c].done)
+            {
+                lane_give(ln, d, c, 0, plan);
+            }
+        }
+        else if (plan->dynamic && d->next < d->chunks.size())
+        {
+            if (!d->chunks[d->next].done) // skip the ones the cache answered
+            {
+                lane_give(ln, d, (int)d->next, 0, plan);
+            }
+            d->next++;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (plan->speculate && ln->queue.empty() && d->retry.empty() && (!plan->dynamic || d->next == d->chunks.size()))
+    {
+        for (size_t c = 0; c < d->chunks.size(); c++) // handed out in order: the first is the oldest
+        {
+            if (!d->chunks[c].done && d->chunks[c].live == 1)
+            {
+                lane_give(ln, d, (int)c, 1, plan);
+                d->backups++;
+                break;
+            }
+        }
+    }
+}
+
+// the lane is up and its worker registered the plan's op
+static int lane_runs(const Lane *ln, const ChunkPlan *plan)
+{
+    return ln->s != INVALID_SOCKET && (ln->ops & (1u << plan->op.op)) != 0;
+}
+
+// poll for NET_OUT exactly while the lane has something to write
+static void lane_sync(NetPoll *p, Lane *ln, int l)
+{
+    int out = ln->sending < ln->queue.size();
+    if (out != ln->out)
+    {
+        netpoll_mod(p, ln->s, l, out ? (NET_IN | NET_OUT) : NET_IN);
+        ln->out = out;
+    }
+}
+
+// the worker died (or hung): close it and put its unanswered chunks back
+static void lane_drop(NetPoll *p, Lane *ln, Dispatch *d)
+{
+    netpoll_del(p, ln->s);
+    closesocket(ln->s);
+    ln->s = INVALID_SOCKET;
+#ifndef _WIN32
+    if (ln->pid > 0)
+    {
+        kill(ln->pid, SIGKILL);
+    }
+#endif
+    for (int a : ln->queue)
+    {
+        Chunk *ch = &d->chunks[(size_t)d->attempts[(size_t)a].chunk];
+        ch->live--;
+        if (!ch->done && ch->live == 0)
+        {
+            d->retry.push_back(d->attempts[(size_t)a].chunk);
+            d->reassigned++;
+        }
+    }
+    ln->queue.clear();
+    ln->sending = 0;
+}
+
+// every lane gets work at once and is refilled as its results come back; results
+// are written wherever they belong as they arrive. A worker that fails is dropped
+// and its chunks go to the others. Returns once every chunk has an answer, which
+// may leave backups' twins in flight: run again with `drain` to collect them (and
+// drop workers that stay silent for DRAIN_MS) before the image buffer is reused.
+#define DRAIN_MS 5000
+static int dispatch_events(vector<Lane> &lanes, Dispatch *d, const ChunkPlan *plan, int drain)
+{
+    NetPoll p;
+    if (!netpoll_open(&p))
+    {
+        printf("poll setup failed\n");
+        return 0;
+    }
+    auto t0 = chrono::steady_clock::now();
+    size_t first = 0;
+    int busy = 0;
+    for (size_t l = 0; l < lanes.size(); l++)
+    {
+        Lane *ln = &lanes[l];
+        if (!lane_runs(ln, plan))
+        {
+            continue;
+        }
+        if (!drain)
+        {
+            ln->queue.clear();
+            ln->sending = 0;
+            ln->idle_since = t0;
+            if (plan->affinity)
+            {
+                for (size_t c = 0; c < d->chunks.size(); c++)
+                {
+                    if (d->chunks[c].holder == ln && !d->chunks[c].done)
+                    {
+                        lane_give(ln, d, (int)c, 0, plan);
+                    }
+                }
+            }
+            else if (!plan->dynamic)
+            {
+                while (first < d->chunks.size() && d->chunks[first].done)
+                {
+                    first++;
+                }
+                if (first < d->chunks.size())
+                {
+                    lane_give(ln, d, (int)first++, 0, plan);
+                }
+            }
+            lane_fill(ln, d, plan);
+        }
+        busy += !ln->queue.empty();
+        ln->out = ln->sending < ln->queue.size();
+        net_set_nonblocking(ln->s, 1);
+        netpoll_add(&p, ln->s, (int)l, ln->out ? (NET_IN | NET_OUT) : NET_IN);
+    }
+
+    int ok = 1;
+    NetEvent ev[64];
+    while (ok && (drain ? busy > 0 : d->done < d->chunks.size()))
+    {
+        int n = netpoll_wait(&p, ev, 64, drain ? DRAIN_MS : -1);
+        if (n < 0)
+        {
+            printf("poll failed\n");
+            ok = 0;
+            break;
+        }
+        if (n == 0) // drain timed out
+        {
+            for (size_t l = 0; l < lanes.size(); l++)
+            {
+                if (lane_runs(&lanes[l], plan) && !lanes[l].queue.empty())
+                {
+                    printf("worker %d hung, dropped\n", (int)l);
+                    lane_drop(&p, &lanes[l], d);
+                }
+            }
+            busy = 0;
+            break;
+        }
+        for (int e = 0; e < n && ok; e++)
+        {
+            int l = ev[e].key;
+            Lane *ln = &lanes[(size_t)l];
+            if (ln->s == INVALID_SOCKET)
+            {
+                continue;
+            }
+            int was_busy = !ln->queue.empty();
+            int failed = 0;
+            if (ev[e].events & (NET_OUT | NET_ERR))
+            {
+                while (ln->sending < ln->queue.size())
+                {
+                    Slab *sl = &d->attempts[(size_t)ln->queue[ln->sending]];
+                    if (!slab_send(sl))
+                    {
+                        failed = 1;
+                        break;
+                    }
+                    if (!slab_sent(sl))
+                    {
+                        break; // socket buffer full
+                    }
+                    ln->sending++;
+                }
+            }
+            if (!failed && (ev[e].events & (NET_IN | NET_ERR)))
+            {
+                while (!ln->queue.empty())
+                {
+                    Slab *sl = &d->attempts[(size_t)ln->queue.front()];
+                    if (!slab_recv(sl))
+                    {
+                        failed = 1;
+                        break;
+                    }
+                    if (!slab_done(sl))
+                    {
+                        break; // rest not here yet
+                    }
+                    ln->queue.pop_front();
+                    ln->sending--;
+                    ln->bytes += sl->bytes;
+                    Chunk *ch = &d->chunks[(size_t)sl->chunk];
+                    ch->live--;
+                    if (ch->done)
+                    {
+                        d->duplicates++;
+                    }
+                    else
+                    {
+                        ch->done = 1;
+                        ch->from_spare = !ch->spare.empty() && sl->dst == ch->spare.data();
+                        ch->holder = ln;
+                        ch->held_job = sl->job;
+                        d->done++;
+                        d->backup_wins += sl->backup;
+                    }
+                    if (!drain)
+                    {
+                        lane_fill(ln, d, plan);
+                    }
+                    if (ln->queue.empty())
+                    {
+                        ln->idle_since = chrono::steady_clock::now();
+                    }
+                }
+                failed |= ln->queue.empty() && (ev[e].events & NET_ERR); // gone, nothing more for it
+            }
+            if (failed)
+            {
+                if (!ln->queue.empty())
+                {
+                    printf("worker %d failed with %d chunks out, reassigning\n", l, (int)ln->queue.size());
+                }
+                lane_drop(&p, ln, d);
+                int alive = 0;
+                for (size_t k = 0; k < lanes.size(); k++)
+                {
+                    if (!lane_runs(&lanes[k], plan))
+                    {
+                        continue;
+                    }
+                    alive++;
+                    if (!drain)
+                    {
+                        int idle = lanes[k].queue.empty();
+                        lane_fill(&lanes[k], d, plan);
+                        busy += idle && !lanes[k].queue.empty();
+                        lane_sync(&p, &lanes[k], (int)k);
+                    }
+                }
+                if (alive == 0 && !drain)
+                {
+                    printf("No workers left\n");
+                    ok = 0;
+                }
+            }
+            else
+            {
+                lane_sync(&p, ln, l);
+            }
+            busy += (int)!ln->queue.empty() - was_busy;
+        }
+    }
+    auto t_end = chrono::steady_clock::now();
+    netpoll_close(&p);
+    for (Lane &ln : lanes)
+    {
+        if (!lane_runs(&ln, plan))
+        {
+            continue;
+        }
+        if (!drain)
+        {
+            ln.idle += chrono::duration<double>(t_end - (ln.queue.empty() ? ln.idle_since : t_end)).count();
+        }
+        net_set_nonblocking(ln.s, 0);
+    }
+    return ok;
+}
+
+// the original loop: send worker i its rows, wait for its result, then worker i + 1
+static int dispatch_sequential(vector<Slab> &slabs)
+{
+    for (size_t i = 0; i < slabs.size(); i++)
+    {
+        Slab *sl = &slabs[i];
+        if (send_all(sl->s, (const char *)sl->hdr, FRAME_BYTES) <= 0)
+        {
+            printf("Failed sending header to worker %d\n", (int)i);
+            return 0;
+        }
+        if (sl->send_bytes > 0 && send_all(sl->s, (const char *)sl->src, sl->send_bytes) <= 0)
+        {
+            printf("Failed sending rows to worker %d\n", (int)i);
+            return 0;
+        }
+        if (recv_all(sl->s, (char *)sl->res, FRAME_BYTES) <= 0 || !slab_result_ok(sl) ||
+            (sl->recv_bytes > 0 && recv_all(sl->s, (char *)sl->dst, sl->recv_bytes) <= 0))
+        {
+            printf("Failed receiving result from worker %d\n", (int)i);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// calc processes that stay connected for every image of the run
+struct WorkerPool
+{
+    SOCKET ls;
+    vector<Lane> lanes; // by worker id (from its HELLO): spawned ones first, then remote
+    ImageStore store;
+    vector<uint8_t> source; // the current image as loaded, for re-sending chunks
+#ifndef _WIN32
+    vector<pid_t> children;
+#endif
+};
+
+// file a connected worker under the id from its HELLO, which must be in [lo, hi)
+static int pool_register(WorkerPool *pool, SOCKET s, int lo, int hi)
+{
+    // the worker registers with its id, whatever order the connections came in
+    JobFrame hello;
+    if (!recv_frame(s, hello) || hello.type != FRAME_HELLO || hello.job < (uint32_t)lo || hello.job >= (uint32_t)hi ||
+        pool->lanes[hello.job].s != INVALID_SOCKET)
+    {
+        printf("Worker registration failed\n");
+        closesocket(s);
+        return 0;
+    }
+    if (hello.version != FRAME_VERSION)
+    {
+        printf("Worker %u speaks protocol %u, expected %u\n", hello.job, hello.version, FRAME_VERSION);
+        closesocket(s);
+        return 0;
+    }
+    Lane *ln = &pool->lanes[hello.job];
+    ln->s = s;
+    ln->ops = (uint32_t)hello.param[0];
+    ln->shm = pool->store.shared && hello.param[1] == 1;
+    ln->chunks = 0;
+    ln->bytes = 0.0;
+    ln->idle = 0.0;
+    return 1;
+}
+
+// accept one worker that dialled in and register it
+static int pool_accept(WorkerPool *pool, int lo, int hi)
+{
+    SOCKET s = accept(pool->ls, NULL, NULL);
+    if (s == INVALID_SOCKET)
+    {
+        printf("Accept failed\n");
+        return 0;
+    }
+    net_set_nodelay(s);
+    return pool_register(pool, s, lo, hi);
+}
 
-    SOCKET ls = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+static int pool_listen(WorkerPool *pool, int port, int backlog)
+{
+    pool->ls = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    int reuse = 1;
+    setsockopt(pool->ls, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
 
     struct sockaddr_in addr = {0};
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
     addr.sin_port = htons(port);
 
-    bind(ls, (struct sockaddr *)&addr, sizeof(addr));
-    listen(ls, num_workers);
+    if (bind(pool->ls, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(pool->ls, backlog) != 0)
+    {
+        printf("Can't listen on port %d\n", port);
+        return 0;
+    }
     printf("Listening on port %d\n", port);
+    return 1;
+}
+
+#ifndef _WIN32
+// the worker's end of its socketpair, in the child
+#define CALC_FD 3
+#endif
+
+// spawn `num_workers` local calc processes, then wait for `remote` more started by
+// hand elsewhere (calc <this host> <port> <id>, ids num_workers and up). Local
+// workers get the shared image unless use_shm is 0, each runs `threads` threads;
+// worker `slow_id` is told to drag its feet by slow_us per row (load-balancing and
+// tail-latency tests).
+//
+// On POSIX a local worker is started with posix_spawn and gets one end of a
+// socketpair as CALC_FD (calc --fd 3 <id>): no port, no accept, and all of them
+// start at once; the pool then reads their HELLOs. Only remote workers need the
+// listening socket. Windows keeps CreateProcess and a connect back to the port.
+static int pool_start(WorkerPool *pool, const char *worker_path, const char *server_ip, int port, int num_workers,
+                      int remote, int use_shm, int threads, int slow_id, int slow_us)
+{
+    pool->ls = INVALID_SOCKET;
+    pool->lanes.assign((size_t)(num_workers + remote), Lane());
+    for (Lane &ln : pool->lanes)
+    {
+        ln.s = INVALID_SOCKET;
+        ln.ops = 0;
+        ln.shm = 0;
+#ifndef _WIN32
+        ln.pid = 0;
+#endif
+    }
+
+    char shm_name[64] = "";
+#ifndef _WIN32
+    if (use_shm)
+    {
+        snprintf(shm_name, sizeof(shm_name), "/spawn-%ld", (long)getpid());
+        pool->store.shared = shmseg_create(&pool->store.seg, shm_name);
+        if (!pool->store.shared)
+        {
+            printf("shm_open %s failed, rows go over the socket\n", shm_name);
+            shm_name[0] = '\0';
+        }
+    }
+#else
+    (void)use_shm;
+#endif
+
+#ifdef _WIN32
+    if (!pool_listen(pool, port, num_workers + remote))
+    {
+        return 0;
+    }
 
     // spawn worker processes +  worker connection
     STARTUPINFO si;
@@ -232,13 +1060,14 @@ int main(int argc, char **argv)
     si.cb = sizeof(si);
     ZeroMemory(&pi, sizeof(pi));
 
-    vector<SOCKET> worker_sockets;
-    worker_sockets.reserve((size_t)num_workers);
-
     for (int i = 0; i < num_workers; i++)
     {
         char cmd[1024];
-        snprintf(cmd, sizeof(cmd), "\"%s\" %s %d %d %d", worker_path, server_ip, port, contrast, i);
+        snprintf(cmd, sizeof(cmd), "\"%s\" %s %d %d --threads %d", worker_path, server_ip, port, i, threads);
+        if (i == slow_id)
+        {
+            snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd), " --slow %d", slow_us);
+        }
         // printf("Spawning: %s\n", cmd);
 
         // Start the child process.
@@ -256,68 +1085,785 @@ int main(int argc, char **argv)
         )
         {
             printf("CreateProcess failed (%d).\n", GetLastError());
-            closesocket(ls);
-            WSACleanup();
-            return 1;
+            return 0;
         }
         CloseHandle(pi.hProcess);
         CloseHandle(pi.hThread);
 
         // printf("Waiting for worker %d to connect...\n", i);
-        SOCKET s = accept(ls, NULL, NULL);
-        if (s == INVALID_SOCKET)
+        if (!pool_accept(pool, 0, num_workers))
         {
-            printf("Accept failed\n");
-            closesocket(ls);
-            WSACleanup();
-            return 1;
+            return 0;
         }
         // printf("Worker %d connected\n", i);
-        worker_sockets.push_back(s);
     }
+#else
+    (void)server_ip;
+    vector<SOCKET> ends;
+    for (int i = 0; i < num_workers; i++)
+    {
+        // both ends close-on-exec: the dup2 below gives the child its own, and no
+        // other worker holds a copy that would hide this one's death
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+        {
+            printf("socketpair failed\n");
+            return 0;
+        }
+        if (sv[1] == CALC_FD)
+        {
+            // dup2 onto itself would keep close-on-exec
+            int moved = fcntl(sv[1], F_DUPFD_CLOEXEC, CALC_FD + 1);
+            close(sv[1]);
+            sv[1] = moved;
+        }
 
-    // sending worker - distribution
-    const int height = img.height;
-    const int base = height / num_workers;
-    const int rem = height % num_workers;
+        char fd_s[16], id_s[16], threads_s[16], slow_s[16];
+        snprintf(fd_s, sizeof(fd_s), "%d", CALC_FD);
+        snprintf(id_s, sizeof(id_s), "%d", i);
+        snprintf(threads_s, sizeof(threads_s), "%d", threads);
+        snprintf(slow_s, sizeof(slow_s), "%d", slow_us);
+        const char *args[12] = {worker_path, "--fd", fd_s, id_s, "--threads", threads_s};
+        int k = 6;
+        if (shm_name[0])
+        {
+            args[k++] = "--shm";
+            args[k++] = shm_name;
+        }
+        if (i == slow_id)
+        {
+            args[k++] = "--slow";
+            args[k++] = slow_s;
+        }
+        args[k] = NULL;
 
-    for (int i = 0; i < num_workers; i++)
+        posix_spawn_file_actions_t fa;
+        posix_spawn_file_actions_init(&fa);
+        posix_spawn_file_actions_adddup2(&fa, sv[1], CALC_FD);
+        pid_t pid;
+        int err = posix_spawn(&pid, worker_path, &fa, NULL, (char *const *)args, environ);
+        posix_spawn_file_actions_destroy(&fa);
+        close(sv[1]);
+        if (err != 0)
+        {
+            printf("posix_spawn %s failed: %s\n", worker_path, strerror(err));
+            close(sv[0]);
+            for (SOCKET s : ends)
+            {
+                closesocket(s);
+            }
+            return 0;
+        }
+        pool->children.push_back(pid);
+        pool->lanes[(size_t)i].pid = pid;
+        ends.push_back(sv[0]);
+    }
+    // every child is starting by now; collect the HELLOs
+    for (size_t i = 0; i < ends.size(); i++)
     {
-        const int rows = base + (i < rem ? 1 : 0);
-        const int start_row = i * base + (i < rem ? i : rem);
+        if (!pool_register(pool, ends[i], 0, num_workers))
+        {
+            for (size_t j = i + 1; j < ends.size(); j++)
+            {
+                closesocket(ends[j]);
+            }
+            return 0;
+        }
+    }
 
-        SOCKET s = worker_sockets[(size_t)i];
+    if (remote > 0 && !pool_listen(pool, port, remote))
+    {
+        return 0;
+    }
+#endif
 
-        printf("Worker %d gets rows %d to %d)\n", i, start_row, start_row + rows);
+    if (remote > 0)
+    {
+        printf("Waiting for %d remote workers (ids %d to %d)\n", remote, num_workers, num_workers + remote - 1);
+    }
+    for (int i = 0; i < remote; i++)
+    {
+        if (!pool_accept(pool, num_workers, num_workers + remote))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-        if (!send_data(s, rows) || !send_data(s, img.width))
+static void pool_stop(WorkerPool *pool)
+{
+    for (Lane &ln : pool->lanes)
+    {
+        if (ln.s != INVALID_SOCKET)
         {
-            printf("Failed sending header to worker %d\n", i);
-            return 1;
+            send_frame(ln.s, frame_make(FRAME_QUIT, 0));
+            closesocket(ln.s);
+        }
+    }
+    if (pool->ls != INVALID_SOCKET)
+    {
+        closesocket(pool->ls);
+    }
+#ifndef _WIN32
+    for (pid_t pid : pool->children)
+    {
+        waitpid(pid, NULL, 0);
+    }
+    if (pool->store.shared)
+    {
+        shmseg_destroy(&pool->store.seg);
+    }
+#endif
+}
+
+// one image of the stream and the kernel it goes through
+struct StreamJob
+{
+    string in;
+    string out;
+    OpSpec op;
+};
+
+// q-th quantile of sorted samples, nearest rank
+static double percentile(const vector<double> &sorted, double q)
+{
+    size_t k = (size_t)(q * (double)sorted.size() + 0.999999);
+    k = (k < 1) ? 1 : k;
+    return sorted[(k > sorted.size() ? sorted.size() : k) - 1];
+}
+
+// what happened over a run of images
+struct RunStats
+{
+    double t_work; // s in dispatch
+    double socket_bytes;
+    vector<double> latency; // s per image, load to save
+    vector<double> stats;   // s per auto-contrast image for the histogram round trip
+    vector<double> hit_latency, miss_latency; // s per image, with --cache
+    int image_hits;
+    int chunk_lookups;
+    int chunk_hits;
+    double chunk_bytes_hit; // image bytes the chunk hits kept off the workers
+    int backups;
+    int backup_wins;
+    int reassigned;
+    int duplicates;
+};
+
+static void run_stats_add(RunStats *st, const Dispatch *d)
+{
+    for (const Slab &sl : d->attempts)
+    {
+        st->socket_bytes += 2.0 * FRAME_BYTES + sl.send_bytes + sl.recv_bytes;
+    }
+    st->backups += d->backups;
+    st->backup_wins += d->backup_wins;
+    st->reassigned += d->reassigned;
+    st->duplicates += d->duplicates;
+}
+
+// what a cached result depends on besides the bytes it was computed from: kind
+// ('I' whole image, 'C' chunk), op + params and the geometry
+static uint64_t cache_seed(int kind, uint32_t op, const int32_t *param, int width, int top, int rows, int bottom)
+{
+    int32_t k[6 + FRAME_PARAMS] = {kind, (int32_t)op, width, top, rows, bottom};
+    memcpy(k + 6, param, FRAME_PARAMS * sizeof(int32_t));
+    if (op == OP_HISTOGRAM)
+    {
+        k[6] = 0; // the image tag: same rows, same counts
+    }
+    return hash64(k, sizeof(k), 0);
+}
+
+// chunks whose rows (halo included) and op were seen before get their result from
+// the cache and count as done before anything is handed out: only the dirty ones
+// go to the workers
+static void cache_chunks_get(ResultCache *cache, Dispatch *d, const ChunkPlan *plan, RunStats *st)
+{
+    const int counts = plan->op.op == OP_HISTOGRAM;
+    for (Chunk &ch : d->chunks)
+    {
+        int top, bottom;
+        chunk_halo(plan, ch.start_row, ch.rows, &top, &bottom);
+        uint64_t seed = cache_seed('C', plan->op.op, plan->op.param, plan->width, top, ch.rows, bottom);
+        const uint8_t *rows = d->source + (size_t)(ch.start_row - top) * plan->padding;
+        ch.key = hash64(rows, (size_t)(top + ch.rows + bottom) * plan->padding, seed);
+
+        size_t len = counts ? (size_t)FRAME_HIST_BYTES : (size_t)ch.rows * plan->padding;
+        const vector<uint8_t> *hit = cache_get(cache, ch.key, len);
+        st->chunk_lookups++;
+        if (!hit)
+        {
+            continue;
+        }
+        if (counts)
+        {
+            ch.stats = *hit;
+        }
+        else
+        {
+            memcpy(d->image + (size_t)ch.start_row * plan->padding, hit->data(), len);
+        }
+        ch.cached = 1;
+        ch.done = 1;
+        d->done++;
+        st->chunk_hits++;
+        st->chunk_bytes_hit += (double)ch.rows * plan->padding;
+    }
+}
+
+// results of the chunks the workers answered, from `image` (rows) or the counts
+static void cache_chunks_put(ResultCache *cache, const Dispatch *d, const ChunkPlan *plan, const uint8_t *image)
+{
+    for (const Chunk &ch : d->chunks)
+    {
+        if (ch.cached)
+        {
+            continue;
+        }
+        if (plan->op.op == OP_HISTOGRAM)
+        {
+            cache_put(cache, ch.key, ch.stats.data(), ch.stats.size(), 0);
+        }
+        else
+        {
+            cache_put(cache, ch.key, image + (size_t)ch.start_row * plan->padding, (size_t)ch.rows * plan->padding, 0);
+        }
+    }
+}
+
+// deal d's chunks out: in order, one worker at a time (events 0: --sequential with
+// static slabs), or over the event loop. An affinity plan hands each chunk to the
+// lane holding its rows when that lane still runs the op.
+static int run_chunks(WorkerPool *pool, Dispatch *d, const ChunkPlan *plan, const vector<int> &live, int events)
+{
+    if (events)
+    {
+        return dispatch_events(pool->lanes, d, plan, 0);
+    }
+    for (size_t i = 0; i < d->chunks.size(); i++)
+    {
+        if (d->chunks[i].done)
+        {
+            continue;
+        }
+        Lane *ln = &pool->lanes[(size_t)live[i]];
+        if (plan->affinity && d->chunks[i].holder && lane_runs(d->chunks[i].holder, plan))
+        {
+            ln = d->chunks[i].holder;
+        }
+        lane_give(ln, d, (int)i, 0, plan);
+        ln->queue.clear();
+    }
+    if (!dispatch_sequential(d->attempts))
+    {
+        return 0;
+    }
+    for (const Slab &sl : d->attempts)
+    {
+        Chunk *ch = &d->chunks[(size_t)sl.chunk];
+        ch->done = 1;
+        ch->holder = sl.lane;
+        ch->held_job = sl.job;
+    }
+    d->done = d->chunks.size();
+    return 1;
+}
+
+// merge the chunks' counts, all three channels together so the stretch keeps the
+// hues, and cut `clip` (in 1/10000) of the bytes off each end
+static void stretch_from_stats(const vector<Chunk> &chunks, int clip, int32_t *lo, int32_t *hi)
+{
+    vector<uint64_t> count(256, 0);
+    uint64_t total = 0;
+    for (const Chunk &ch : chunks)
+    {
+        for (int i = 0; i < 3 * 256; i++)
+        {
+            uint32_t n = frame_get(ch.stats.data() + 4 * i);
+            count[(size_t)(i & 255)] += n;
+            total += n;
         }
+    }
+    uint64_t cut = total * (uint64_t)clip / 10000;
+    int a = 0, b = 255;
+    uint64_t below = 0, above = 0;
+    while (a < 255 && below + count[(size_t)a] <= cut)
+    {
+        below += count[(size_t)a++];
+    }
+    while (b > 0 && above + count[(size_t)b] <= cut)
+    {
+        above += count[(size_t)b--];
+    }
+    if (b <= a) // (nearly) one value: leave the image alone
+    {
+        a = 0;
+        b = 255;
+    }
+    *lo = a;
+    *hi = b;
+}
 
-        const int img_bytes = rows * padding;
-        const uint8_t *src = img.bgr.data() + (size_t)start_row * (size_t)padding;
+// one image through the pool with `op`: one slab per live worker that runs it, or
+// chunk_rows-row chunks dealt out dynamically with at most `inflight` queued per
+// worker. With a cache, an image seen before with the same op is answered without
+// the workers, and otherwise only the chunks that changed are sent.
+static int run_image(WorkerPool *pool, ResultCache *cache, const char *input_bmp, const char *output_bmp, const OpSpec *op,
+                     const ChunkPlan *opts, int chunk_rows, int sequential, int verbose, uint32_t *next_job, RunStats *st)
+{
+    auto t_load = chrono::steady_clock::now();
+    BMPImage24 img = load_bmp(input_bmp, &pool->store);
+    const int padding = row_padded(img.width);
+    const int height = img.height;
+    const size_t bytes = (size_t)height * (size_t)padding;
 
-        if (img_bytes > 0 && send_all(s, (const char *)src, img_bytes) <= 0)
+    uint64_t image_key = 0;
+    if (cache)
+    {
+        image_key = hash64(img.pixels, bytes, cache_seed('I', op->op, op->param, img.width, 0, height, 0));
+        const vector<uint8_t> *hit = cache_get(cache, image_key, bytes);
+        if (hit)
         {
-            printf("Failed sending rows to worker %d\n", i);
+            memcpy(img.pixels, hit->data(), bytes);
+            save_bmp(output_bmp, &img);
+            st->image_hits++;
+            st->latency.push_back(seconds_since(t_load));
+            st->hit_latency.push_back(st->latency.back());
+            if (verbose)
+            {
+                printf("output: %s (from the cache)\n", output_bmp);
+            }
             return 1;
         }
+    }
+
+    ChunkPlan plan = *opts;
+    plan.dynamic = (chunk_rows > 0);
+    plan.width = img.width;
+    plan.height = height;
+    plan.padding = padding;
+    plan.op = *op;
+    plan.halo = frame_op_halo(op->op, op->param);
+    if (op->op == OP_TONEMAP)
+    {
+        frame_put_double(plan.op.param + 2, log_average(&img));
+    }
 
-        uint8_t *dst = img.bgr.data() + (size_t)start_row * (size_t)padding;
-        if (img_bytes > 0 && recv_all(s, (char *)dst, img_bytes) <= 0)
+    vector<int> live;
+    for (size_t l = 0; l < pool->lanes.size(); l++)
+    {
+        if (lane_runs(&pool->lanes[l], &plan))
         {
-            printf("Failed receiving result from worker %d\n", i);
+            live.push_back((int)l);
+        }
+    }
+    const int num_workers = (int)live.size();
+    if (num_workers == 0)
+    {
+        printf("No worker left that runs %s\n", op_name(op->op));
+        return 0;
+    }
+    if (verbose)
+    {
+        printf("op %s, %d halo rows\n", (op->op == OP_STRETCH && op->param[0] < 0) ? "autocontrast" : op_name(op->op),
+               plan.halo);
+    }
+
+    Dispatch d;
+    d.next = 0;
+    d.done = 0;
+    d.image = img.pixels;
+    d.source = img.pixels;
+    d.next_job = next_job;
+    d.backups = d.backup_wins = d.reassigned = d.duplicates = 0;
+    if (plan.dynamic)
+    {
+        for (int start_row = 0; start_row < height; start_row += chunk_rows)
+        {
+            Chunk ch = Chunk();
+            ch.start_row = start_row;
+            ch.rows = (height - start_row < chunk_rows) ? height - start_row : chunk_rows;
+            d.chunks.push_back(ch);
+        }
+        if (verbose)
+        {
+            printf("%d chunks of %d rows, up to %d in flight per worker\n", (int)d.chunks.size(), chunk_rows, plan.inflight);
+        }
+    }
+    else
+    {
+        // sending worker - distribution
+        const int base = height / num_workers;
+        const int rem = height % num_workers;
+        d.chunks.resize((size_t)num_workers);
+        for (int i = 0; i < num_workers; i++)
+        {
+            d.chunks[(size_t)i].rows = base + (i < rem ? 1 : 0);
+            d.chunks[(size_t)i].start_row = i * base + (i < rem ? i : rem);
+            if (verbose)
+            {
+                printf("Worker %d gets rows %d to %d)%s\n", live[(size_t)i], d.chunks[(size_t)i].start_row,
+                       d.chunks[(size_t)i].start_row + d.chunks[(size_t)i].rows,
+                       (pool->lanes[(size_t)live[(size_t)i]].shm && plan.halo == 0) ? " in shared memory" : "");
+            }
+        }
+    }
+
+    // the event loop may send chunks again after a worker (or the shared image) has
+    // changed them, and a halo overlaps rows the worker before has answered: both
+    // send from a snapshot of the image as loaded
+    const int events = !(sequential && !plan.dynamic);
+    if (events || plan.halo > 0)
+    {
+        pool->source.assign(img.pixels, img.pixels + bytes);
+        d.source = pool->source.data();
+    }
+
+    auto t0 = chrono::steady_clock::now();
+    int ok = 1;
+    if (plan.op.op == OP_STRETCH && plan.op.param[0] < 0)
+    {
+        // auto contrast, round one: the chunks' histograms, with every late twin
+        // collected before round two reuses the lanes; the workers keep the rows
+        ChunkPlan count = plan;
+        count.op.op = OP_HISTOGRAM;
+        count.op.param[0] = (int32_t)*next_job; // image tag
+        Dispatch h = d;
+        if (cache)
+        {
+            cache_chunks_get(cache, &h, &count, st);
+        }
+        ok = run_chunks(pool, &h, &count, live, events) && (!events || dispatch_events(pool->lanes, &h, &count, 1));
+        if (ok && cache)
+        {
+            cache_chunks_put(cache, &h, &count, NULL);
+        }
+        if (ok)
+        {
+            // round two: the stretch as APPLY frames to whoever holds the rows; a
+            // chunk whose holder is gone is sent again with its rows
+            stretch_from_stats(h.chunks, plan.op.param[2], &plan.op.param[0], &plan.op.param[1]);
+            plan.affinity = 1;
+            d.next = d.chunks.size();
+            for (size_t c = 0; c < d.chunks.size(); c++)
+            {
+                d.chunks[c].holder = h.chunks[c].holder;
+                d.chunks[c].held_job = h.chunks[c].held_job;
+                if (events && !d.chunks[c].done && (!d.chunks[c].holder || !lane_runs(d.chunks[c].holder, &plan)))
+                {
+                    d.retry.push_back((int)c);
+                }
+            }
+            st->stats.push_back(seconds_since(t0));
+            if (verbose)
+            {
+                printf("histograms of %d chunks in %.4f s: stretch %d..%d\n", (int)h.chunks.size(), st->stats.back(),
+                       plan.op.param[0], plan.op.param[1]);
+            }
+        }
+        run_stats_add(st, &h);
+    }
+    if (ok && cache)
+    {
+        cache_chunks_get(cache, &d, &plan, st);
+    }
+    if (ok)
+    {
+        ok = run_chunks(pool, &d, &plan, live, events);
+    }
+    st->t_work += seconds_since(t0);
+    if (!ok)
+    {
+        return 0;
+    }
+
+    // a straggler may still be writing the shared image: results that came in
+    // through a spare go into a copy, and the copy is saved
+    BMPImage24 out = img;
+    vector<uint8_t> patched;
+    for (const Chunk &ch : d.chunks)
+    {
+        if (ch.from_spare)
+        {
+            if (patched.empty())
+            {
+                patched.assign(img.pixels, img.pixels + bytes);
+                out.pixels = patched.data();
+            }
+            memcpy(out.pixels + (size_t)ch.start_row * padding, ch.spare.data(), ch.spare.size());
+        }
+    }
+    save_bmp(output_bmp, &out);
+    st->latency.push_back(seconds_since(t_load));
+    if (cache)
+    {
+        st->miss_latency.push_back(st->latency.back());
+        cache_chunks_put(cache, &d, &plan, out.pixels);
+        cache_put(cache, image_key, out.pixels, bytes, 1);
+    }
+    if (verbose)
+    {
+        printf("output: %s\n", output_bmp);
+    }
+
+    // collect the answers nobody waits for any more, so the next image can reuse
+    // the buffers
+    if (events && !dispatch_events(pool->lanes, &d, &plan, 1))
+    {
+        return 0;
+    }
+    run_stats_add(st, &d);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    // ./spawn calc 10 input.bmp output.bmp
+    if (argc < 5)
+    {
+        printf("Usage: ./spawn <worker_exe> <num_workers> <input.bmp> <output.bmp> [--sequential] [--stream list.txt] [--repeat k]\n");
+        printf("                [--tcp] [--remote k [--port p]] [--chunk rows [--inflight k]] [--slow id[:us]]\n");
+        printf("                [--speculate] [--threads n] [--op name[:params]] [--cache mb] [--cache-dir dir[:mb]]\n");
+        printf("       list.txt: one \"input.bmp output.bmp [op]\" line per image, run after the first pair\n");
+        printf("       --op: contrast[:c] (-50), balance[:b,g,r] (0.9,0.8,1.0), blur[:passes] (1), tonemap[:key] (0.18),\n");
+        printf("             stretch:lo,hi, autocontrast[:clip%%] (0.5: histograms first, then the stretch they give)\n");
+        printf("       --tcp: local workers get their rows over the socket instead of the shared image\n");
+        printf("       --remote k: also wait for k workers started by hand (calc <host> <port> <id>) on --port (5000)\n");
+        printf("       --chunk rows: deal the image out in chunks of `rows`, at most --inflight (2) queued per worker\n");
+        printf("       --slow id[:us]: worker `id` sleeps `us` (20) per row (simulated noisy box)\n");
+        printf("       --speculate: once every chunk is out, idle workers re-run the ones still outstanding\n");
+        printf("       --threads n: threads per spawned worker\n");
+        printf("       --cache mb: keep results by content hash, whole images and chunks (LRU, mb of memory)\n");
+        printf("       --cache-dir dir[:mb]: also keep whole images as files in dir (LRU, 256 mb); memory\n");
+        printf("             as with --cache 256 unless --cache is given (0: no chunks, images only from dir)\n");
+        return 1;
+    }
+
+    const char *worker_path = argv[1];
+    int num_workers = atoi(argv[2]);
+    int sequential = 0;
+    int repeat = 1;
+    int use_shm = 1;
+    int remote = 0;
+    int chunk_rows = 0;
+    int inflight = 2;
+    int slow_id = -1;
+    int slow_us = 20;
+    int port = PORT;
+    int threads = 1;
+    int speculate = 0;
+    double cache_mb = -1.0; // not given
+    string cache_dir; // empty: memory only
+    double cache_disk_mb = 256.0;
+
+    // the op for images that don't name their own; found before the list is read
+    OpSpec op;
+    parse_op("contrast", &op);
+    for (int i = 5; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], "--op") == 0 && !parse_op(argv[i + 1], &op))
+        {
+            printf("Unknown op: %s\n", argv[i + 1]);
             return 1;
         }
     }
 
-    save_bmp(output_bmp, &img);
-    printf("output: %s\n", output_bmp);
+    vector<StreamJob> jobs;
+    jobs.push_back(StreamJob{string(argv[3]), string(argv[4]), op});
+    for (int i = 5; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--sequential") == 0)
+        {
+            sequential = 1;
+        }
+        else if (strcmp(argv[i], "--tcp") == 0)
+        {
+            use_shm = 0;
+        }
+        else if (strcmp(argv[i], "--chunk") == 0 && i + 1 < argc)
+        {
+            chunk_rows = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--inflight") == 0 && i + 1 < argc)
+        {
+            inflight = atoi(argv[++i]);
+            inflight = (inflight < 1) ? 1 : inflight;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--speculate") == 0)
+        {
+            speculate = 1;
+        }
+        else if (strcmp(argv[i], "--slow") == 0 && i + 1 < argc)
+        {
+            sscanf(argv[++i], "%d:%d", &slow_id, &slow_us);
+        }
+        else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+        {
+            port = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--remote") == 0 && i + 1 < argc)
+        {
+            remote = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+        {
+            repeat = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--op") == 0 && i + 1 < argc)
+        {
+            i++; // read above
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+        {
+            cache_mb = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc)
+        {
+            // dir[:mb]; a drive letter's colon is part of the dir
+            cache_dir = argv[++i];
+            size_t colon = cache_dir.rfind(':');
+            if (colon != string::npos && colon > 1)
+            {
+                cache_disk_mb = atof(cache_dir.c_str() + colon + 1);
+                cache_dir.resize(colon);
+            }
+        }
+        else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc)
+        {
+            FILE *list = fopen(argv[++i], "r");
+            if (!list)
+            {
+                printf("Error opening file: %s\n", argv[i]);
+                return 1;
+            }
+            char line[2200], in[1024], out[1024], name[128];
+            while (fgets(line, sizeof(line), list))
+            {
+                int n = sscanf(line, "%1023s %1023s %127s", in, out, name);
+                if (n < 2)
+                {
+                    continue;
+                }
+                StreamJob job = {string(in), string(out), op};
+                if (n == 3 && !parse_op(name, &job.op))
+                {
+                    printf("Unknown op in %s: %s\n", argv[i], name);
+                    fclose(list);
+                    return 1;
+                }
+                jobs.push_back(job);
+            }
+            fclose(list);
+        }
+    }
+
+    const char *server_ip = IP;
+
+    // Server setup
+    WSADATA w;
+    WSAStartup(MAKEWORD(2, 2), &w);
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN); // a dead worker shows up as a failed send, not a signal
+#endif
+
+    auto t_start = chrono::steady_clock::now();
+    WorkerPool pool;
+    if (!pool_start(&pool, worker_path, server_ip, port, num_workers, remote, use_shm, threads, slow_id, slow_us))
+    {
+        pool_stop(&pool);
+        WSACleanup();
+        return 1;
+    }
+    double t_spawn = seconds_since(t_start);
+
+    // the pool stays up for the whole stream
+    auto t_stream = chrono::steady_clock::now();
+    uint32_t next_job = 0;
+    ChunkPlan opts = ChunkPlan();
+    opts.inflight = inflight;
+    opts.speculate = speculate;
+    RunStats st = RunStats();
+    int images = 0;
+
+    if (cache_mb < 0.0)
+    {
+        cache_mb = cache_dir.empty() ? 0.0 : 256.0;
+    }
+    const int use_cache = cache_mb > 0.0 || !cache_dir.empty();
+    if (use_cache && cache_mb == 0.0)
+    {
+        printf("cache: no memory budget, chunks are not cached and every hit is read from %s\n", cache_dir.c_str());
+    }
+    ResultCache cache;
+    if (use_cache && !cache_open(&cache, (size_t)(cache_mb * 1e6), cache_dir.empty() ? NULL : cache_dir.c_str(),
+                                 (size_t)(cache_disk_mb * 1e6)))
+    {
+        printf("Can't use %s for the cache, memory only\n", cache_dir.c_str());
+    }
+    for (int r = 0; r < repeat; r++)
+    {
+        for (size_t j = 0; j < jobs.size(); j++)
+        {
+            int verbose = (jobs.size() == 1 && repeat == 1);
+            if (!run_image(&pool, use_cache ? &cache : NULL, jobs[j].in.c_str(), jobs[j].out.c_str(), &jobs[j].op, &opts,
+                           chunk_rows, sequential, verbose, &next_job, &st))
+            {
+                pool_stop(&pool);
+                WSACleanup();
+                return 1;
+            }
+            images++;
+        }
+    }
+    double t_all = seconds_since(t_stream);
+
+    int shared = 0;
+    for (size_t i = 0; i < pool.lanes.size(); i++)
+    {
+        const Lane &ln = pool.lanes[i];
+        shared += ln.shm;
+        double busy = st.t_work - ln.idle;
+        printf("worker %d: %d chunks, idle %.4f s (%.1f%%), %.1f MB/s while busy%s\n", (int)i, ln.chunks, ln.idle,
+               (st.t_work > 0.0) ? 100.0 * ln.idle / st.t_work : 0.0, (busy > 0.0) ? ln.bytes / busy / 1e6 : 0.0,
+               (ln.s == INVALID_SOCKET) ? ", dropped" : "");
+    }
+    printf("%d workers (%d on the shared image): spawn + connect %.4f s, dispatch (%s) %.4f s, total %.4f s\n",
+           (int)pool.lanes.size(), shared, t_spawn, sequential ? "sequential" : "event loop", st.t_work, seconds_since(t_start));
+    printf("%d images, %u jobs in %.4f s: %.1f images/s, %.1f jobs/s, socket traffic %.2f MB\n", images, next_job, t_all,
+           images / t_all, next_job / t_all, st.socket_bytes / 1e6);
+    sort(st.latency.begin(), st.latency.end());
+    printf("image latency: p50 %.4f s, p99 %.4f s, max %.4f s\n", percentile(st.latency, 0.50), percentile(st.latency, 0.99),
+           st.latency.back());
+    printf("%d backups (%d answered first), %d chunks reassigned from failed workers, %d late duplicates dropped\n",
+           st.backups, st.backup_wins, st.reassigned, st.duplicates);
+    if (use_cache)
+    {
+        sort(st.hit_latency.begin(), st.hit_latency.end());
+        sort(st.miss_latency.begin(), st.miss_latency.end());
+        printf("cache: %d/%d images hit (%.1f%%, %d from disk), %d/%d chunks hit (%.1f%%, %.2f MB not sent)\n",
+               st.image_hits, images, 100.0 * st.image_hits / images, cache.disk_hits, st.chunk_hits, st.chunk_lookups,
+               st.chunk_lookups ? 100.0 * st.chunk_hits / st.chunk_lookups : 0.0, st.chunk_bytes_hit / 1e6);
+        if (!st.hit_latency.empty() && !st.miss_latency.empty())
+        {
+            double hit = percentile(st.hit_latency, 0.50), miss = percentile(st.miss_latency, 0.50);
+            printf("cache: image latency p50 %.4f s on a hit, %.4f s otherwise: about %.4f s saved\n", hit, miss,
+                   st.image_hits * (miss - hit));
+        }
+    }
+    if (!st.stats.empty())
+    {
+        sort(st.stats.begin(), st.stats.end());
+        printf("auto contrast: %d images, histogram round trip p50 %.4f s, p99 %.4f s\n", (int)st.stats.size(),
+               percentile(st.stats, 0.50), percentile(st.stats, 0.99));
+    }
 
-    for (SOCKET s : worker_sockets)
-    closesocket(s);
+    pool_stop(&pool);
     WSACleanup();
     return 0;
 }
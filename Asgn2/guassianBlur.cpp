@@ -16,6 +16,14 @@
 #include <math.h>
 #include <mpi.h> //mpiexec
 
+#include "../common/mpi_slab.h"
+#include "../common/mpi_sched.h"
+#include "../common/stencil.h"
+
+#include "../common/placement.h"
+#include "../common/spinlock.h"
+#include "../common/lockstat.h"
+
 #pragma pack(push, 1)
 struct BMPFileHeader
 {
@@ -51,10 +59,12 @@ struct BMPImage24
     int width = 0;
     int height = 0;
     int pre_height = 0;
+    long data_offset = 0; // file offset of the pixel data
     std::vector<uint8_t> bgr; // BGR data
 };
 
-static BMPImage24 load_bmp(const char *filename)
+// header_only: stop after the headers (--shm reads the pixels into the shared window)
+static BMPImage24 load_bmp(const char *filename, int header_only)
 {
     FILE *file = fopen(filename, "rb");
     if (!file)
@@ -87,6 +97,14 @@ static BMPImage24 load_bmp(const char *filename)
     img.width = ih.biWidth;
     img.height = (ih.biHeight > 0) ? ih.biHeight : -ih.biHeight;
     img.pre_height = ih.biHeight;
+    img.data_offset = (long)fh.bfOffBits;
+
+    if (header_only)
+    {
+        fclose(file);
+        printf("BMP Header loaded: %dx%d\n", img.width, img.height);
+        return img;
+    }
 
     int padding = row_padded(img.width);
     int image_bytes = padding * img.height;
@@ -110,7 +128,37 @@ static BMPImage24 load_bmp(const char *filename)
     return img;
 }
 
-static void save_bmp(const char *filename, const BMPImage24 *img)
+// file + info header in front of the pixel data (54 bytes)
+struct BMPHeaders
+{
+    BMPFileHeader fh;
+    BMPInfoHeader ih;
+};
+
+static BMPHeaders make_bmp_headers(const BMPImage24 *img)
+{
+    int width = img->width;
+    int height = img->height;
+    int padding = row_padded(width);
+
+    BMPHeaders h;
+    memset(&h, 0, sizeof(h));
+    h.fh.bfType = 0x4D42;
+    h.fh.bfOffBits = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
+    h.fh.bfSize = h.fh.bfOffBits + (unsigned int)(padding * height);
+
+    h.ih.biSize = sizeof(BMPInfoHeader);
+    h.ih.biWidth = width;
+    h.ih.biHeight = img->pre_height;
+    h.ih.biPlanes = 1;
+    h.ih.biBitCount = 24;
+    h.ih.biCompression = 0;
+    h.ih.biSizeImage = (unsigned int)(padding * height);
+    return h;
+}
+
+// pixels: img->height rows of row_padded(width) bytes, e.g. a shared window
+static void save_bmp_pixels(const char *filename, const BMPImage24 *img, const uint8_t *pixels)
 {
     FILE *file = fopen(filename, "wb");
     if (!file)
@@ -123,70 +171,69 @@ static void save_bmp(const char *filename, const BMPImage24 *img)
         printf("Saving file: %s\n", filename);
     }
 
-    int width = img->width;
-    int height = img->height;
-    int padding = row_padded(width);
-
-    struct BMPFileHeader fh;
-    memset(&fh, 0, sizeof(fh));
-    fh.bfType = 0x4D42;
-    fh.bfOffBits = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
-    fh.bfSize = fh.bfOffBits + (unsigned int)(padding * height);
-
-    struct BMPInfoHeader ih;
-    memset(&ih, 0, sizeof(ih));
-    ih.biSize = sizeof(BMPInfoHeader);
-    ih.biWidth = width;
-    ih.biHeight = img->pre_height;
-    ih.biPlanes = 1;
-    ih.biBitCount = 24;
-    ih.biCompression = 0;
-    ih.biSizeImage = (unsigned int)(padding * height);
-
-    fwrite(&fh, sizeof(fh), 1, file);
-    fwrite(&ih, sizeof(ih), 1, file);
-    fwrite(img->bgr.data(), 1, img->bgr.size(), file);
+    BMPHeaders h = make_bmp_headers(img);
+    fwrite(&h.fh, sizeof(h.fh), 1, file);
+    fwrite(&h.ih, sizeof(h.ih), 1, file);
+    fwrite(pixels, 1, (size_t)row_padded(img->width) * img->height, file);
     fclose(file);
 }
 
-/* class code mutex */
-/* mutex is a synchronization primitive that enforeces limit
-    on access to a shared resource when having multiple thread of execution
-*/
-typedef struct
-{
-    std::atomic_flag f;
-} lock_t;
-static void init(lock_t *m)
+static void save_bmp(const char *filename, const BMPImage24 *img)
 {
-    atomic_flag_clear(&m->f); // f=0
+    save_bmp_pixels(filename, img, img->bgr.data());
 }
-static void lock(lock_t *m) // t1t2
+
+// --flag anywhere after the positional arguments
+static int has_flag(int argc, char **argv, const char *flag)
 {
-    while (atomic_flag_test_and_set(&m->f))
+    for (int i = 1; i < argc; i++)
     {
-        // spin
+        if (strcmp(argv[i], flag) == 0)
+        {
+            return 1;
+        }
     }
+    return 0;
 }
-static void unlock(lock_t *m)
+
+// --flag <int>, or def when absent
+static int flag_int(int argc, char **argv, const char *flag, int def)
 {
-    atomic_flag_clear(&m->f);
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], flag) == 0)
+        {
+            return atoi(argv[i + 1]);
+        }
+    }
+    return def;
 }
 
+/* class code mutex */
+/* mutex is a synchronization primitive that enforeces limit
+    on access to a shared resource when having multiple thread of execution
+*/
+// TTAS lock from common/spinlock.h, instrumented by common/lockstat.h with -DLOCK_STATS
+typedef STAT_LOCK(ttas_lock_t) lock_t;
+
 /* guassian blur :
 p[i] = p[i] * 0.399050
 + p[i +1] *(0.242036) + p[i +2] *(0.054005) + p[i +3] *(0.004433)
 + p[i -1] *(0.242036) + p[i -2] *(0.054005) + p[i -3] *(0.004433);
 */
-const double weights[] = {
-    0.399050,
-    0.242036,
-    0.054005,
-    0.004433
+// one group per tap keeps the tap-by-tap double sum of the original loop
+struct Gauss7
+{
+    static constexpr StencilTap taps[] = {{0, -3}, {0, -2}, {0, -1}, {0, 0}, {0, 1}, {0, 2}, {0, 3}};
+    static constexpr StencilGroup groups[] = {{0.004433, 1}, {0.054005, 1}, {0.242036, 1}, {0.399050, 1},
+                                              {0.242036, 1}, {0.054005, 1}, {0.004433, 1}};
+    static constexpr int renormalize = 1; // edge pixels average over the taps in the image
 };
 /* guassian horizontal blur */
-void horizontal_blur(uint8_t *data, int rnum, int width, int *next_row, lock_t *m)
+void horizontal_blur(uint8_t *data, int rnum, int width, int *next_row, lock_t *m, int cpu, int id)
 {
+    pin_thread(cpu);
+    LOCKSTAT_THREAD(id);
     int padding = row_padded(width);
     std::vector<uint8_t> rtemp(padding);
 
@@ -201,44 +248,22 @@ void horizontal_blur(uint8_t *data, int rnum, int width, int *next_row, lock_t *
         }
         (*next_row)++;
         unlock(m);
+        LOCKSTAT_CLAIM();
 
         memcpy(rtemp.data(), &data[sr * padding], padding);
-        for (int x = 0; x < width; x++)
-        {
-            double weight_count = 0.0;
-            double b = 0.0, g = 0.0, r = 0.0;
-
-            // offset
-            for (int c = -3; c <= 3; c++)
-            {
-                int neigh_x = x + c;
-
-                // check for corner/bound
-                if (neigh_x >= 0 && neigh_x < width)
-                {
-                    double weight_value = weights[abs(c)];
-                    int in = neigh_x * 3;
-                    b += rtemp[in + 0] * weight_value;
-                    g += rtemp[in + 1] * weight_value;
-                    r += rtemp[in + 2] * weight_value;
-                    weight_count += weight_value;
-                }
-            }
-            int out = (sr * padding) + (x * 3);
-            data[out + 0] = b / weight_count;
-            data[out + 1] = g / weight_count;
-            data[out + 2] = r / weight_count;
-        }
+        stencil_row<Gauss7>(rtemp.data(), padding, &data[sr * padding], 0, width, 1);
     }
 }
 
 /* guassian vertical blur */
 // data[col*3 + y*rwb+coloroffset]
-void vertical_blur(uint8_t *data, int width, int height, int *next_col, lock_t *m)
+void vertical_blur(uint8_t *data, int width, int height, int *next_col, lock_t *m, int cpu, int id)
 {
+    pin_thread(cpu);
+    LOCKSTAT_THREAD(id);
     int rwb_padding = row_padded(width);
 
-    std::vector<uint8_t> ctemp(height * 3);
+    std::vector<uint8_t> ctemp(height * 3), cblur(height * 3);
     while (true)
     {
         lock(m);
@@ -250,6 +275,7 @@ void vertical_blur(uint8_t *data, int width, int height, int *next_col, lock_t *
         }
         (*next_col)++;
         unlock(m);
+        LOCKSTAT_CLAIM();
 
         for (int y = 0; y < height; y++)
         {
@@ -258,35 +284,75 @@ void vertical_blur(uint8_t *data, int width, int height, int *next_col, lock_t *
             ctemp[y * 3 + 2] = data[(col * 3) + (y * rwb_padding) + 2];
         }
 
+        // the column is a one-row image of `height` pixels
+        stencil_row<Gauss7>(ctemp.data(), 0, cblur.data(), 0, height, 1);
         for (int y = 0; y < height; y++)
         {
-            double b = 0.0, g = 0.0, r = 0.0;
-            double weight_count = 0.0;
-
-            // offset
-            for (int c = -3; c <= 3; c++)
-            {
-                int neigh_y = y + c;
-
-                // check for corner/bound
-                if (neigh_y >= 0 && neigh_y < height)
-                {
-                    double weight_value = weights[abs(c)];
-                    int in = neigh_y * 3;
-                    b += ctemp[in + 0] * weight_value;
-                    g += ctemp[in + 1] * weight_value;
-                    r += ctemp[in + 2] * weight_value;
-                    weight_count += weight_value;
-                }
-            }
-            int out = (y * rwb_padding) + (col * 3);
-            data[out + 0] = b / weight_count;
-            data[out + 1] = g / weight_count;
-            data[out + 2] = r / weight_count;
+            data[(col * 3) + (y * rwb_padding) + 0] = cblur[y * 3 + 0];
+            data[(col * 3) + (y * rwb_padding) + 1] = cblur[y * 3 + 1];
+            data[(col * 3) + (y * rwb_padding) + 2] = cblur[y * 3 + 2];
         }
     }
 }
 
+// c threads share the rows of one slab / chunk
+static void horizontal_pass(uint8_t *rows, int nrows, int width, int c, lock_t *m, const std::vector<int> &cpus)
+{
+    int next_row = 0;
+    std::vector<std::thread> hworkers;
+    for (int i = 0; i < c; i++)
+    {
+        hworkers.emplace_back(horizontal_blur, rows, nrows, width, &next_row, m, cpus[i], i);
+    }
+    for (int i = 0; i < c; i++)
+    {
+        hworkers[i].join();
+    }
+}
+
+// --dynamic: rank 0 deals out guided row chunks, a worker blurs one and hands it
+// back with its next request
+static double dynamic_horizontal(int round, BMPImage24 *img, int c, lock_t *m, const std::vector<int> &cpus,
+                                 int min_rows, int slow_rank, std::vector<std::vector<RowChunk>> *log)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    int padding = row_padded(img->width);
+    double busy = 0.0;
+
+    if (rank == 0)
+    {
+        sched_serve(
+            round, img->height, min_rows,
+            [&](int w, RowChunk ch) {
+                MPI_Send(img->bgr.data() + (size_t)ch.start * padding, ch.count * padding, MPI_UNSIGNED_CHAR, w, TAG_SCHED_ROWS, MPI_COMM_WORLD);
+            },
+            [&](int w, RowChunk ch) {
+                MPI_Recv(img->bgr.data() + (size_t)ch.start * padding, ch.count * padding, MPI_UNSIGNED_CHAR, w, TAG_SCHED_ROWS, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            },
+            log);
+        return busy;
+    }
+
+    std::vector<uint8_t> rows;
+    RowChunk done = {0, 0}, next;
+    auto send_back = [&](RowChunk ch) {
+        MPI_Send(rows.data(), ch.count * padding, MPI_UNSIGNED_CHAR, 0, TAG_SCHED_ROWS, MPI_COMM_WORLD);
+    };
+    while (sched_request(round, &done, &next, send_back))
+    {
+        rows.resize((size_t)next.count * padding);
+        MPI_Recv(rows.data(), next.count * padding, MPI_UNSIGNED_CHAR, 0, TAG_SCHED_ROWS, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+        double t0 = MPI_Wtime();
+        horizontal_pass(rows.data(), next.count, img->width, c, m, cpus);
+        slow_down(slow_rank, t0);
+        busy += MPI_Wtime() - t0;
+        done = next;
+    }
+    return busy;
+}
+
 // mpi_gatherv - gather from all process in a group
 void gather(void *send_buf, int send_count, void *recv_buf, int *recv_count, int *displs)
 {
@@ -301,9 +367,9 @@ int main(int argc, char **argv)
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);   // rank == id
     MPI_Comm_size(MPI_COMM_WORLD, &nprocs); // total worker
 
-    if (argc < 4)
+    if (argc < 5)
     {
-        printf("Usage: mpiexec -n <c> %s <n> <c> <input.bmp> <output.bmp>\n", argv[0]);
+        printf("Usage: mpiexec -n <c> %s <n> <c> <input.bmp> <output.bmp> [none|compact|scatter] [--shm | --dynamic [--chunk rows]] [--slow rank]\n", argv[0]);
         MPI_Finalize();
         return 1;
     }
@@ -312,8 +378,48 @@ int main(int argc, char **argv)
     int c = atoi(argv[2]);
     const char *input_bmp = argv[3];
     const char *output_bmp = argv[4];
+    PlacementPolicy policy = (argc >= 6 && argv[5][0] != '-') ? parse_placement(argv[5]) : PLACE_NONE;
+
+    // --shm: the image lives in one node-shared window, horizontal passes run on
+    // each rank's rows in place and rank 0 blurs columns on the same memory
+    int use_shm = has_flag(argc, argv, "--shm");
+    if (use_shm && !shm_single_node())
+    {
+        if (rank == 0)
+            printf("--shm: ranks span several nodes, using scatter/gather\n");
+        use_shm = 0;
+    }
+
+    // --dynamic: rank 0 only schedules horizontal rows (and blurs columns)
+    int use_dynamic = has_flag(argc, argv, "--dynamic");
+    int min_rows = flag_int(argc, argv, "--chunk", 4);
+    int slow_rank = flag_int(argc, argv, "--slow", -1);
+    if (use_dynamic && nprocs < 2)
+    {
+        if (rank == 0)
+            printf("--dynamic needs a master and at least one worker, using static rows\n");
+        use_dynamic = 0;
+    }
+    if (use_dynamic)
+    {
+        use_shm = 0;
+    }
 
-    BMPImage24 img = load_bmp(input_bmp);
+    // ranks sharing a host take disjoint slices of the cpu order
+    MPI_Comm node_comm;
+    int local_rank;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &local_rank);
+    MPI_Comm_free(&node_comm);
+
+    Topology topo = read_topology();
+    std::vector<int> cpus = placement_cpus(topo, policy, c, local_rank * c);
+    if (rank == 0)
+    {
+        print_placement(topo, policy, cpus);
+    }
+
+    BMPImage24 img = load_bmp(input_bmp, use_shm);
 
     const int N = img.height;
     int base = N / nprocs;
@@ -338,32 +444,74 @@ int main(int argc, char **argv)
     }
 
     double start = MPI_Wtime();
-    uint8_t *loc = (uint8_t *)malloc(nloc * padding);
+    uint8_t *loc;
+    ShmImage shm;
+    if (use_shm)
+    {
+        int start_row, rows;
+        slab_rows(N, nprocs, rank, &start_row, &rows);
+        shm_alloc((MPI_Aint)N * padding, &shm);
+        if (rank == 0)
+        {
+            read_pixels(input_bmp, img.data_offset, shm.base, (size_t)N * padding);
+        }
+        MPI_Win_fence(0, shm.win);
+        loc = shm.base + (size_t)start_row * padding;
+    }
+    else
+    {
+        loc = (uint8_t *)malloc(nloc * padding);
+    }
+    if (policy != PLACE_NONE && !use_shm)
+    {
+        // first touch from the pinned workers before MPI writes into it
+        parallel_first_touch(loc, (size_t)nloc * padding, cpus);
+    }
     lock_t m;
     init(&m);
+    double busy = 0.0; // horizontal pass time on this rank
+    std::vector<std::vector<RowChunk>> log;
 
     for (int i = 0; i < n; i++)
     {
         // if (rank == 0) printf("iteration %d/%d\n", i + 1, n);
-        MPI_Scatterv(img.bgr.data(), counts, displs, MPI_UNSIGNED_CHAR, loc, nloc * padding, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
-        // if (rank == 1 && i == 0)
-        // {
-        //     printf("rank 1 received first Byte: %d\n", loc[0]);
-        // }
-
-        int next_row = 0;
-        std::vector<std::thread> hworkers;
-        for (int i = 0; i < c; i++)
+        uint8_t *whole = img.bgr.data();
+        if (use_dynamic)
         {
-            hworkers.emplace_back(horizontal_blur, loc, nloc, img.width, &next_row, &m);
+            busy += dynamic_horizontal(i, &img, c, &m, cpus, min_rows, slow_rank, &log);
         }
-        for (int i = 0; i < c; i++)
+        else
         {
-            hworkers[i].join();
+            if (!use_shm)
+            {
+                MPI_Scatterv(img.bgr.data(), counts, displs, MPI_UNSIGNED_CHAR, loc, nloc * padding, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+            }
+            // if (rank == 1 && i == 0)
+            // {
+            //     printf("rank 1 received first Byte: %d\n", loc[0]);
+            // }
+
+            double t0 = MPI_Wtime();
+            horizontal_pass(loc, nloc, img.width, c, &m, cpus);
+            slow_down(slow_rank, t0);
+            busy += MPI_Wtime() - t0;
+            // if (rank == 1 && i == 0) printf("horizontal done\n");
         }
-        // if (rank == 1 && i == 0) printf("horizontal done\n");
 
-        gather(loc, (nloc * padding), img.bgr.data(), counts, displs);
+        if (use_dynamic)
+        {
+            // rows already back on rank 0
+        }
+        else if (use_shm)
+        {
+            // every slab's horizontal pass is visible to rank 0
+            MPI_Win_fence(0, shm.win);
+            whole = shm.base;
+        }
+        else
+        {
+            gather(loc, (nloc * padding), img.bgr.data(), counts, displs);
+        }
 
         if (rank == 0)
         {
@@ -371,7 +519,7 @@ int main(int argc, char **argv)
             std::vector<std::thread> vworkers;
             for (int i = 0; i < c; i++)
             {
-                vworkers.emplace_back(vertical_blur, img.bgr.data(), img.width, img.height, &next_col, &m);
+                vworkers.emplace_back(vertical_blur, whole, img.width, img.height, &next_col, &m, cpus[i], i);
             }
             for (int i = 0; i < c; i++)
             {
@@ -379,17 +527,45 @@ int main(int argc, char **argv)
             }
             // printf("vertical done\n");
         }
+        if (use_shm)
+        {
+            // columns done before anyone starts the next horizontal pass
+            MPI_Win_fence(0, shm.win);
+        }
     }
     double end = MPI_Wtime();
 
+    report_imbalance(use_dynamic ? "dynamic rows, horizontal (workers)" : "static rows, horizontal", busy, use_dynamic ? 1 : 0);
+    if (use_dynamic && rank == 0)
+    {
+        for (size_t w = 1; w < log.size(); w++)
+        {
+            printf("  rank %zu: %zu chunks in the last iteration\n", w, log[w].size());
+        }
+    }
+
     if (rank == 0)
     {
         printf("Time: %.4f sec\n", end - start);
 
-        save_bmp(output_bmp, &img);
+        if (use_shm)
+        {
+            save_bmp_pixels(output_bmp, &img, shm.base);
+        }
+        else
+        {
+            save_bmp(output_bmp, &img);
+        }
         printf("output: %s\n", output_bmp);
     }
-    free(loc);
+    if (use_shm)
+    {
+        shm_free(&shm);
+    }
+    else
+    {
+        free(loc);
+    }
     if (rank == 0)
     {
         free(counts);
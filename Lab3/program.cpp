@@ -12,8 +12,16 @@
 #include <atomic>
 #include <stdatomic.h>
 #include <thread>
+#include <chrono>
 #include <math.h>
 
+#include "../common/placement.h"
+
+#define CACHE_LINE 64   // flags that threads spin on each get their own line
+#define MAX_THREADS 256
+#define MAX_ROUNDS 8    // ceil(log2(MAX_THREADS))
+#define TREE_FANIN 4    // arrivals combined per tree node
+
 #pragma pack(push, 1)
 struct BMPFileHeader
 {
@@ -44,7 +52,8 @@ struct BMPImage24
     int width = 0;
     int height = 0;
     int pre_height = 0;
-    std::vector<uint8_t> rgb; // RGB data
+    long data_offset = 0; // file offset of the pixel data (for deferred loads)
+    std::vector<uint8_t, no_init_allocator<uint8_t>> rgb; // RGB data
 };
 
 static int row_padded(int width)
@@ -53,7 +62,9 @@ static int row_padded(int width)
     return (width * 3 + 3) & (~3);
 }
 
-static BMPImage24 load_bmp(const char *filename)
+// defer_pixels: only read the headers and allocate rgb untouched; each worker thread
+// then reads and first-touches its own part (load_pixel_range)
+static BMPImage24 load_bmp(const char *filename, int defer_pixels)
 {
     FILE *file = fopen(filename, "rb");
     if (!file)
@@ -97,6 +108,15 @@ static BMPImage24 load_bmp(const char *filename)
     img.pre_height = ih.biHeight;
 
     int strde = row_padded(img.width);
+    img.data_offset = (long)fh.bfOffBits;
+
+    if (defer_pixels)
+    {
+        img.rgb.resize((size_t)strde * img.height);
+        fclose(file);
+        printf("BMP Image header loaded: %dx%d (pixels read by workers)\n", img.width, img.height);
+        return img;
+    }
     img.rgb.assign((size_t)strde * img.height, 0);
 
     if (fseek(file, fh.bfOffBits, SEEK_SET) != 0)
@@ -204,6 +224,28 @@ static void save_bmp(const char *filename, const BMPImage24 *img)
     fclose(file);
 }
 
+// deferred load of pixels [start_pixel, end_pixel): read the bytes in place from the
+// calling thread, then BGR->RGB
+static void load_pixel_range(const char *filename, BMPImage24 *img, size_t start_pixel, size_t end_pixel)
+{
+    size_t strde = (size_t)row_padded(img->width);
+    size_t begin = (start_pixel / img->width) * strde + (start_pixel % img->width) * 3;
+    size_t end = (end_pixel / img->width) * strde + (end_pixel % img->width) * 3;
+
+    if (end > begin && !read_file_range(filename, img->data_offset + (long)begin, &img->rgb[begin], end - begin))
+    {
+        printf("Error reading pixel data\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = start_pixel; i < end_pixel; i++)
+    {
+        size_t off = (i / img->width) * strde + (i % img->width) * 3;
+        uint8_t b = img->rgb[off + 0];
+        img->rgb[off + 0] = img->rgb[off + 2];
+        img->rgb[off + 2] = b;
+    }
+}
+
 static void free_image(struct BMPImage24 *img)
 {
     img->rgb.clear();
@@ -214,6 +256,16 @@ static void free_image(struct BMPImage24 *img)
 
 // reversing_barrier.cpp
 
+// Split-phase barriers
+// every barrier below is split into arrive() and wait(token): arrive() announces this
+// thread and never blocks, wait(token) blocks until everyone has arrived. Work placed
+// between the two overlaps with the stragglers. xxx_wait() is arrive + wait back to back.
+struct BarrierToken
+{
+    int sense; // phase this thread arrived in
+    int stop;  // where arrival stopped (tree node / tournament or dissemination round)
+};
+
 // DIY Gate Barrier
 struct DIYGateBarrier
 {
@@ -229,7 +281,7 @@ static inline void diy_gate_barrier_init(struct DIYGateBarrier *barrier, int nth
     barrier->gate.store(0, std::memory_order_relaxed);
 }
 
-static inline void diy_gate_barrier_wait(struct DIYGateBarrier *barrier)
+static inline BarrierToken diy_gate_barrier_arrive(struct DIYGateBarrier *barrier)
 {
     int my_gate = barrier->gate.load(std::memory_order_relaxed);
     int position = atomic_fetch_add(&(barrier->count), 1);
@@ -239,16 +291,23 @@ static inline void diy_gate_barrier_wait(struct DIYGateBarrier *barrier)
         barrier->count.store(0, std::memory_order_release);
         barrier->gate.store(!my_gate, std::memory_order_release); // open the gate
     }
-    else
+    return BarrierToken{my_gate, 0};
+}
+
+static inline void diy_gate_barrier_wait_token(struct DIYGateBarrier *barrier, BarrierToken token)
+{
+    // wait until gate is opened
+    while (barrier->gate.load(std::memory_order_acquire) == token.sense)
     {
-        // wait until gate is opened
-        while (barrier->gate.load(std::memory_order_acquire) == my_gate)
-        {
-            std::this_thread::yield(); // yield to other threads
-        }
+        std::this_thread::yield(); // yield to other threads
     }
 }
 
+static inline void diy_gate_barrier_wait(struct DIYGateBarrier *barrier)
+{
+    diy_gate_barrier_wait_token(barrier, diy_gate_barrier_arrive(barrier));
+}
+
 // Sense Reversing Barrier
 struct SenseReversingBarrier
 {
@@ -264,7 +323,7 @@ static inline void rbarrier_init(struct SenseReversingBarrier *barrier, int nthr
     barrier->sense.store(0, std::memory_order_relaxed); // initial global sense is 0
 }
 
-static inline void rbarrier_wait(struct SenseReversingBarrier *barrier, int *local_sense)
+static inline BarrierToken rbarrier_arrive(struct SenseReversingBarrier *barrier, int *local_sense)
 {
     *local_sense = !(*local_sense); // flip local sense
     int ls = *local_sense;
@@ -275,36 +334,552 @@ static inline void rbarrier_wait(struct SenseReversingBarrier *barrier, int *loc
         barrier->count.store(barrier->nthreads, std::memory_order_release);
         barrier->sense.store(ls, std::memory_order_release);
     }
-    else
+    return BarrierToken{ls, 0};
+}
+
+static inline void rbarrier_wait_token(struct SenseReversingBarrier *barrier, BarrierToken token)
+{
+    // wait until global sense equals local sense
+    while (barrier->sense.load(std::memory_order_acquire) != token.sense)
+    {
+        std::this_thread::yield(); // yield to other threads
+    }
+}
+
+static inline void rbarrier_wait(struct SenseReversingBarrier *barrier, int *local_sense)
+{
+    rbarrier_wait_token(barrier, rbarrier_arrive(barrier, local_sense));
+}
+
+// Scalable barriers
+// the two barriers above put every arrival on one counter and every waiter on one flag,
+// which serializes at high thread counts. The three below spread arrivals and wakeups
+// over many flags, each padded to its own cache line.
+
+struct alignas(CACHE_LINE) PaddedFlag
+{
+    std::atomic<int> v{0};
+};
+
+// Combining Tree Barrier
+// threads arrive at a leaf in groups of TREE_FANIN, the last arrival at each node
+// carries on to the parent; waiters only spin on their own node's sense
+struct alignas(CACHE_LINE) TreeNode
+{
+    std::atomic<int> count{0};
+    std::atomic<int> sense{0};
+    int fanin;  // arrivals expected at this node
+    int parent; // -1 for root
+    int slot;   // which of the parent's children this node is
+};
+
+struct CombiningTreeBarrier
+{
+    int nthreads;
+    int nnodes;
+    TreeNode nodes[MAX_THREADS];
+    int leaf[MAX_THREADS]; // leaf node of each thread
+};
+
+static void tree_barrier_init(struct CombiningTreeBarrier *barrier, int nthreads)
+{
+    barrier->nthreads = nthreads;
+    barrier->nnodes = 0;
+
+    // build bottom up: level 0 groups threads, each next level groups the nodes below
+    int level_first = 0;
+    int level_count = (nthreads + TREE_FANIN - 1) / TREE_FANIN;
+    for (int i = 0; i < level_count; i++)
+    {
+        TreeNode *nd = &barrier->nodes[i];
+        nd->fanin = std::min(TREE_FANIN, nthreads - i * TREE_FANIN);
+        nd->parent = -1;
+        nd->slot = i % TREE_FANIN;
+    }
+    for (int t = 0; t < nthreads; t++)
+    {
+        barrier->leaf[t] = t / TREE_FANIN;
+    }
+    barrier->nnodes = level_count;
+
+    while (level_count > 1)
+    {
+        int next_first = barrier->nnodes;
+        int next_count = (level_count + TREE_FANIN - 1) / TREE_FANIN;
+        for (int i = 0; i < next_count; i++)
+        {
+            TreeNode *nd = &barrier->nodes[next_first + i];
+            nd->fanin = std::min(TREE_FANIN, level_count - i * TREE_FANIN);
+            nd->parent = -1;
+            nd->slot = i % TREE_FANIN;
+        }
+        for (int i = 0; i < level_count; i++)
+        {
+            barrier->nodes[level_first + i].parent = next_first + i / TREE_FANIN;
+        }
+        barrier->nnodes += next_count;
+        level_first = next_first;
+        level_count = next_count;
+    }
+
+    for (int i = 0; i < barrier->nnodes; i++)
+    {
+        barrier->nodes[i].count.store(barrier->nodes[i].fanin, std::memory_order_relaxed);
+        barrier->nodes[i].sense.store(0, std::memory_order_relaxed);
+    }
+}
+
+// climb while this thread is the last arrival; stop at the first node still missing
+// someone (token.stop) or at the root (token.stop = -1)
+static inline BarrierToken tree_barrier_arrive(struct CombiningTreeBarrier *barrier, int id, int *local_sense)
+{
+    *local_sense = !(*local_sense);
+    int node = barrier->leaf[id];
+    while (node >= 0 && barrier->nodes[node].count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        node = barrier->nodes[node].parent;
+    }
+    return BarrierToken{*local_sense, node};
+}
+
+static inline void tree_barrier_wait_token(struct CombiningTreeBarrier *barrier, int id, BarrierToken token)
+{
+    if (token.stop >= 0)
+    {
+        while (barrier->nodes[token.stop].sense.load(std::memory_order_acquire) != token.sense)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    // release the nodes this thread completed, top down so a parent is reset
+    // before anyone released below it can arrive there again
+    int path[MAX_ROUNDS];
+    int depth = 0;
+    for (int node = barrier->leaf[id]; node != token.stop; node = barrier->nodes[node].parent)
+    {
+        path[depth++] = node;
+    }
+    for (int d = depth - 1; d >= 0; d--)
+    {
+        TreeNode *nd = &barrier->nodes[path[d]];
+        nd->count.store(nd->fanin, std::memory_order_relaxed);
+        nd->sense.store(token.sense, std::memory_order_release);
+    }
+}
+
+static inline void tree_barrier_wait(struct CombiningTreeBarrier *barrier, int id, int *local_sense)
+{
+    tree_barrier_wait_token(barrier, id, tree_barrier_arrive(barrier, id, local_sense));
+}
+
+// Reducing Barrier (barrier + allreduce)
+// same tree as the combining tree barrier, but every arrival carries a value. The last
+// arrival at a node combines its children's values in child order and carries the
+// partial up; the root's result is handed back down on release, so one episode both
+// synchronizes and gives every thread the same reduced value.
+typedef double (*reduce_fn)(double, double);
+
+static inline double reduce_sum(double a, double b) { return a + b; }
+static inline double reduce_min(double a, double b) { return (b < a) ? b : a; }
+static inline double reduce_max(double a, double b) { return (b > a) ? b : a; }
+
+struct alignas(CACHE_LINE) ReduceSlots
+{
+    double vals[TREE_FANIN]; // one per child, written before the child arrives
+    double result;           // published before the node's sense flips
+};
+
+struct ReducingBarrier
+{
+    CombiningTreeBarrier tree;
+    ReduceSlots slots[MAX_THREADS];
+    reduce_fn op;
+};
+
+static void reduce_barrier_init(struct ReducingBarrier *barrier, int nthreads, reduce_fn op)
+{
+    tree_barrier_init(&barrier->tree, nthreads);
+    barrier->op = op;
+}
+
+static inline BarrierToken reduce_barrier_arrive(struct ReducingBarrier *barrier, int id, int *local_sense, double value)
+{
+    *local_sense = !(*local_sense);
+    CombiningTreeBarrier *tree = &barrier->tree;
+
+    int node = tree->leaf[id];
+    int slot = id % TREE_FANIN;
+    double v = value;
+    while (node >= 0)
+    {
+        barrier->slots[node].vals[slot] = v;
+        if (tree->nodes[node].count.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        {
+            break;
+        }
+
+        // last one here: combine in child order so every run sums the same way
+        const double *vals = barrier->slots[node].vals;
+        v = vals[0];
+        for (int c = 1; c < tree->nodes[node].fanin; c++)
+        {
+            v = barrier->op(v, vals[c]);
+        }
+        if (tree->nodes[node].parent < 0)
+        {
+            barrier->slots[node].result = v;
+        }
+        slot = tree->nodes[node].slot;
+        node = tree->nodes[node].parent;
+    }
+    return BarrierToken{*local_sense, node};
+}
+
+static inline double reduce_barrier_wait_token(struct ReducingBarrier *barrier, int id, BarrierToken token)
+{
+    CombiningTreeBarrier *tree = &barrier->tree;
+    int root = tree->nnodes - 1;
+
+    if (token.stop >= 0)
+    {
+        while (tree->nodes[token.stop].sense.load(std::memory_order_acquire) != token.sense)
+        {
+            std::this_thread::yield();
+        }
+    }
+    double result = barrier->slots[(token.stop >= 0) ? token.stop : root].result;
+
+    // release top down, handing the result to each node first
+    int path[MAX_ROUNDS];
+    int depth = 0;
+    for (int node = tree->leaf[id]; node != token.stop; node = tree->nodes[node].parent)
+    {
+        path[depth++] = node;
+    }
+    for (int d = depth - 1; d >= 0; d--)
+    {
+        TreeNode *nd = &tree->nodes[path[d]];
+        barrier->slots[path[d]].result = result;
+        nd->count.store(nd->fanin, std::memory_order_relaxed);
+        nd->sense.store(token.sense, std::memory_order_release);
+    }
+    return result;
+}
+
+static inline double reduce_barrier_wait(struct ReducingBarrier *barrier, int id, int *local_sense, double value)
+{
+    return reduce_barrier_wait_token(barrier, id, reduce_barrier_arrive(barrier, id, local_sense, value));
+}
+
+// Tournament Barrier
+// round k pairs thread i with i ^ 2^k; the lower id (winner) waits for the loser's
+// arrive flag and moves on, the loser drops out and waits to be woken. Thread 0 is
+// the champion and starts the wakeup, which retraces the tournament in reverse.
+struct TournamentBarrier
+{
+    int nthreads;
+    int rounds;
+    PaddedFlag arrive[MAX_THREADS][MAX_ROUNDS]; // set by the loser of round k
+    PaddedFlag wakeup[MAX_THREADS];             // set by the winner that beat this thread
+};
+
+static void tournament_barrier_init(struct TournamentBarrier *barrier, int nthreads)
+{
+    barrier->nthreads = nthreads;
+    barrier->rounds = 0;
+    while ((1 << barrier->rounds) < nthreads)
+    {
+        barrier->rounds++;
+    }
+    for (int i = 0; i < nthreads; i++)
+    {
+        for (int k = 0; k < MAX_ROUNDS; k++)
+        {
+            barrier->arrive[i][k].v.store(0, std::memory_order_relaxed);
+        }
+        barrier->wakeup[i].v.store(0, std::memory_order_relaxed);
+    }
+}
+
+// play rounds from `k` until this thread loses, has to wait for a partner (blocking = 0)
+// or wins them all; returns the round it stopped in
+static inline int tournament_play(struct TournamentBarrier *barrier, int id, int ls, int k, int blocking)
+{
+    for (; k < barrier->rounds; k++)
+    {
+        int step = 1 << k;
+        if (id & step)
+        {
+            barrier->arrive[id - step][k].v.store(ls, std::memory_order_release);
+            return k;
+        }
+        if (id + step < barrier->nthreads)
+        {
+            while (barrier->arrive[id][k].v.load(std::memory_order_acquire) != ls)
+            {
+                if (!blocking)
+                {
+                    return k;
+                }
+                std::this_thread::yield();
+            }
+        }
+    }
+    return k;
+}
+
+static inline BarrierToken tournament_barrier_arrive(struct TournamentBarrier *barrier, int id, int *local_sense)
+{
+    *local_sense = !(*local_sense);
+    int k = tournament_play(barrier, id, *local_sense, 0, 0);
+    return BarrierToken{*local_sense, k};
+}
+
+static inline void tournament_barrier_wait_token(struct TournamentBarrier *barrier, int id, BarrierToken token)
+{
+    int ls = token.sense;
+    int k = token.stop;
+
+    // a winner that stopped early finishes its remaining rounds
+    if (k < barrier->rounds && !(id & (1 << k)))
+    {
+        k = tournament_play(barrier, id, ls, k, 1);
+    }
+    if (k < barrier->rounds)
+    {
+        // lost round k: wait to be woken
+        while (barrier->wakeup[id].v.load(std::memory_order_acquire) != ls)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    // wakeup: release the threads this one beat, latest round first
+    for (k = k - 1; k >= 0; k--)
+    {
+        int partner = id + (1 << k);
+        if (partner < barrier->nthreads)
+        {
+            barrier->wakeup[partner].v.store(ls, std::memory_order_release);
+        }
+    }
+}
+
+static inline void tournament_barrier_wait(struct TournamentBarrier *barrier, int id, int *local_sense)
+{
+    tournament_barrier_wait_token(barrier, id, tournament_barrier_arrive(barrier, id, local_sense));
+}
+
+// Dissemination Barrier
+// ceil(log2 n) rounds, in round k thread i signals thread (i + 2^k) % n and waits for
+// its own flag. No thread is special and there is no separate wakeup phase.
+// Flags alternate between two parity sets so one episode cannot clobber the next.
+struct alignas(CACHE_LINE) DisseminationState
+{
+    int parity;
+    int sense;
+};
+
+struct DisseminationBarrier
+{
+    int nthreads;
+    int rounds;
+    PaddedFlag flags[MAX_THREADS][2][MAX_ROUNDS];
+    DisseminationState state[MAX_THREADS];
+};
+
+static void dissemination_barrier_init(struct DisseminationBarrier *barrier, int nthreads)
+{
+    barrier->nthreads = nthreads;
+    barrier->rounds = 0;
+    while ((1 << barrier->rounds) < nthreads)
+    {
+        barrier->rounds++;
+    }
+    for (int i = 0; i < nthreads; i++)
     {
-        // wait until global sense equals local sense
-        while (barrier->sense.load(std::memory_order_acquire) != ls)
+        for (int p = 0; p < 2; p++)
         {
-            std::this_thread::yield(); // yield to other threads
+            for (int k = 0; k < MAX_ROUNDS; k++)
+            {
+                barrier->flags[i][p][k].v.store(0, std::memory_order_relaxed);
+            }
         }
+        barrier->state[i].parity = 0;
+        barrier->state[i].sense = 1;
     }
 }
 
+static inline void dissemination_signal(struct DisseminationBarrier *barrier, int id, int k)
+{
+    DisseminationState *st = &barrier->state[id];
+    int partner = (id + (1 << k)) % barrier->nthreads;
+    barrier->flags[partner][st->parity][k].v.store(st->sense, std::memory_order_release);
+}
+
+static inline int dissemination_received(struct DisseminationBarrier *barrier, int id, int k)
+{
+    DisseminationState *st = &barrier->state[id];
+    return barrier->flags[id][st->parity][k].v.load(std::memory_order_acquire) == st->sense;
+}
+
+// signal round after round for as long as the incoming flags are already there
+static inline BarrierToken dissemination_barrier_arrive(struct DisseminationBarrier *barrier, int id)
+{
+    int k = 0;
+    while (k < barrier->rounds)
+    {
+        dissemination_signal(barrier, id, k);
+        if (!dissemination_received(barrier, id, k))
+        {
+            break;
+        }
+        k++;
+    }
+    return BarrierToken{barrier->state[id].sense, k};
+}
+
+static inline void dissemination_barrier_wait_token(struct DisseminationBarrier *barrier, int id, BarrierToken token)
+{
+    // round token.stop was already signalled by arrive
+    for (int k = token.stop; k < barrier->rounds; k++)
+    {
+        if (k != token.stop)
+        {
+            dissemination_signal(barrier, id, k);
+        }
+        while (!dissemination_received(barrier, id, k))
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    DisseminationState *st = &barrier->state[id];
+    if (st->parity == 1)
+    {
+        st->sense = !st->sense;
+    }
+    st->parity = 1 - st->parity;
+}
+
+static inline void dissemination_barrier_wait(struct DisseminationBarrier *barrier, int id)
+{
+    dissemination_barrier_wait_token(barrier, id, dissemination_barrier_arrive(barrier, id));
+}
+
 // tone_mapping.cpp
+enum SyncMode
+{
+    REDUCE_BARRIER = -1, // tone mapping only: the allreduce on g_reduce, not in bench's gather loop
+    SENSE_REVERSING_BARRIER = 0,
+    DIY_GATE_BARRIER = 1,
+    TREE_BARRIER = 2,
+    TOURNAMENT_BARRIER = 3,
+    DISSEMINATION_BARRIER = 4,
+    SYNC_MODE_COUNT = 5
+};
+
+static const char *mode_name(int mode)
+{
+    switch (mode)
+    {
+    case REDUCE_BARRIER:
+        return "allreduce";
+    case SENSE_REVERSING_BARRIER:
+        return "sense reversing";
+    case DIY_GATE_BARRIER:
+        return "DIY gate";
+    case TREE_BARRIER:
+        return "combining tree";
+    case TOURNAMENT_BARRIER:
+        return "tournament";
+    case DISSEMINATION_BARRIER:
+        return "dissemination";
+    }
+    return "unknown";
+}
+
 static DIYGateBarrier g_diy;
 static SenseReversingBarrier g_sense;
+static CombiningTreeBarrier g_tree;
+static TournamentBarrier g_tournament;
+static DisseminationBarrier g_dissemination;
+static ReducingBarrier g_reduce; // stage 1 sum of log luminance
+static std::vector<double> g_partial_sums; // per thread, when a gather barrier carries stage 1
 
-static double g_partial_sums[4]; // THREADS = 4
 static double g_Lavg = 1.0;
+static std::vector<float, no_init_allocator<float>> g_lum; // per-pixel luminance, filled while waiting at the first barrier
 
-// gather function
-static inline void gather(int use_sense, int *local_sense)
+static void barrier_init(int mode, int nthreads)
 {
-    if (use_sense == 0)
+    switch (mode)
     {
-        rbarrier_wait(&g_sense, local_sense);
+    case SENSE_REVERSING_BARRIER:
+        rbarrier_init(&g_sense, nthreads);
+        break;
+    case DIY_GATE_BARRIER:
+        diy_gate_barrier_init(&g_diy, nthreads);
+        break;
+    case TREE_BARRIER:
+        tree_barrier_init(&g_tree, nthreads);
+        break;
+    case TOURNAMENT_BARRIER:
+        tournament_barrier_init(&g_tournament, nthreads);
+        break;
+    case DISSEMINATION_BARRIER:
+        dissemination_barrier_init(&g_dissemination, nthreads);
+        break;
     }
-    else
+}
+
+// split-phase gather: arrive now, do independent work, then wait on the token
+static inline BarrierToken gather_arrive(int mode, int id, int *local_sense)
+{
+    switch (mode)
+    {
+    case SENSE_REVERSING_BARRIER:
+        return rbarrier_arrive(&g_sense, local_sense);
+    case DIY_GATE_BARRIER:
+        return diy_gate_barrier_arrive(&g_diy);
+    case TREE_BARRIER:
+        return tree_barrier_arrive(&g_tree, id, local_sense);
+    case TOURNAMENT_BARRIER:
+        return tournament_barrier_arrive(&g_tournament, id, local_sense);
+    case DISSEMINATION_BARRIER:
+        return dissemination_barrier_arrive(&g_dissemination, id);
+    }
+    return BarrierToken{0, 0};
+}
+
+static inline void gather_wait(int mode, int id, BarrierToken token)
+{
+    switch (mode)
     {
-        diy_gate_barrier_wait(&g_diy);
+    case SENSE_REVERSING_BARRIER:
+        rbarrier_wait_token(&g_sense, token);
+        break;
+    case DIY_GATE_BARRIER:
+        diy_gate_barrier_wait_token(&g_diy, token);
+        break;
+    case TREE_BARRIER:
+        tree_barrier_wait_token(&g_tree, id, token);
+        break;
+    case TOURNAMENT_BARRIER:
+        tournament_barrier_wait_token(&g_tournament, id, token);
+        break;
+    case DISSEMINATION_BARRIER:
+        dissemination_barrier_wait_token(&g_dissemination, id, token);
+        break;
     }
 }
 
+// gather function
+static inline void gather(int mode, int id, int *local_sense)
+{
+    gather_wait(mode, id, gather_arrive(mode, id, local_sense));
+}
+
 struct ThreadData
 {
     int id;
@@ -312,14 +887,41 @@ struct ThreadData
     size_t start_pixel;
     size_t end_pixel;
     int local_sense;
-    int use_sense; // 0: sense reversing barrier, 1: diy gate barrier
+    int reduce_sense; // sense for g_reduce, separate from the gather barrier
+    int mode;         // SyncMode, REDUCE_BARRIER: stage 1 goes through g_reduce
+    int cpu;          // pinned cpu, -1 if not pinned
+    const char *pixel_file; // non-NULL: this thread loads its own pixels first
     BMPImage24 *img;
 };
 
+// luminance of pixels [start, end) into g_lum, for stage 2
+static void fill_luminance(const BMPImage24 &img, size_t start, size_t end)
+{
+    int strde = row_padded(img.width);
+    for (size_t i = start; i < end; i++)
+    {
+        size_t row = i / (size_t)img.width;
+        size_t col = i % (size_t)img.width;
+        size_t off = row * (size_t)strde + col * 3;
+
+        double r = img.rgb[off + 0] / 255.0;
+        double g = img.rgb[off + 1] / 255.0;
+        double b = img.rgb[off + 2] / 255.0;
+        g_lum[i] = (float)(0.2126 * r + 0.7152 * g + 0.0722 * b);
+    }
+}
+
 static void threadfct(ThreadData *td)
 {
     BMPImage24 &img = *(td->img);
 
+    // pin first, then first-touch this thread's pixels so they live on its node
+    pin_thread(td->cpu);
+    if (td->pixel_file)
+    {
+        load_pixel_range(td->pixel_file, &img, td->start_pixel, td->end_pixel);
+    }
+
     // Stage 1: compute global avg brightness sum
     const double a = 0.18; // exposure key value
 
@@ -339,27 +941,41 @@ static void threadfct(ThreadData *td)
         double L = 0.2126 * r + 0.7152 * g + 0.0722 * b;
         global_sum += log(L + 1.0);
     }
-    g_partial_sums[td->id] = global_sum;
 
-    gather(td->use_sense, &td->local_sense);
-
-    // Lavg = exp(S / N) - 1
-    if (td->id == 0)
+    // split phase: arrive carrying the partial sum, then fill this thread's part of
+    // the luminance plane while the slower threads are still in stage 1
+    double S = 0.0;
+    if (td->mode == REDUCE_BARRIER)
+    {
+        BarrierToken token = reduce_barrier_arrive(&g_reduce, td->id, &td->reduce_sense, global_sum);
+        fill_luminance(img, td->start_pixel, td->end_pixel);
+        // S comes back already summed across all threads, no serial step and no second barrier
+        S = reduce_barrier_wait_token(&g_reduce, td->id, token);
+    }
+    else
     {
-        double S = 0.0;
+        // the selected barrier instead: one episode, then every thread adds up the
+        // partials itself in the same order, so all of them get the same S
+        g_partial_sums[td->id] = global_sum;
+        BarrierToken token = gather_arrive(td->mode, td->id, &td->local_sense);
+        fill_luminance(img, td->start_pixel, td->end_pixel);
+        gather_wait(td->mode, td->id, token);
         for (int i = 0; i < td->tc; i++)
         {
             S += g_partial_sums[i];
         }
-        double N = img.width * img.height;
-        double Lavg = exp(S / N) - 1.0;
+    }
 
+    // Lavg = exp(S / N) - 1
+    double N = img.width * img.height;
+    double Lavg = exp(S / N) - 1.0;
+
+    if (td->id == 0)
+    {
         g_Lavg = Lavg;
         printf("Computed Lavg: %f\n", g_Lavg);
     }
 
-    gather(td->use_sense, &td->local_sense);
-
     // Stage 2: tone map each pixel (Reinhard Operator))
     // L = 0.2126 R + 0.7152 G + 0.0722 B
     // Lm = (a / Lavg) * L
@@ -373,9 +989,8 @@ static void threadfct(ThreadData *td)
         double r = img.rgb[off + 0] / 255.0;
         double g = img.rgb[off + 1] / 255.0;
         double b = img.rgb[off + 2] / 255.0;
-        double L = 0.2126 * r + 0.7152 * g + 0.0722 * b;
+        double L = g_lum[i];
 
-        double Lavg = g_Lavg;
         double Lm = (a / Lavg) * L;
         double Ld = Lm / (1.0 + Lm);
 
@@ -394,45 +1009,42 @@ static void threadfct(ThreadData *td)
         img.rgb[off + 2] = b_new;
 
     }
-
-    gather(td->use_sense, &td->local_sense);
 }
 
-static void tone_mapping(BMPImage24 *img, int use_sense)
+// pixel_file: set when img was loaded with defer_pixels
+static void tone_mapping(BMPImage24 *img, int mode, int nthreads, PlacementPolicy policy, const char *pixel_file)
 {
-    std::thread threads[4];
-    ThreadData td[4];
+    std::vector<std::thread> threads(nthreads);
+    std::vector<ThreadData> td(nthreads);
 
     size_t total_pixels = img->width * img->height;
-    size_t pixels_per_thread = (total_pixels + 4 - 1) / 4;
+    size_t pixels_per_thread = (total_pixels + nthreads - 1) / nthreads;
 
-    if (use_sense == 0)
-    {
-        rbarrier_init(&g_sense, 4);
-    }
-    else
-    {
-        diy_gate_barrier_init(&g_diy, 4);
-    }
+    barrier_init(mode, nthreads);
+    reduce_barrier_init(&g_reduce, nthreads, reduce_sum);
+    g_partial_sums.assign(nthreads, 0.0);
 
     printf("Total pixels: %zu, Pixels per thread: %zu\n", total_pixels, pixels_per_thread);
-    // Initialize g_partial_sums
-    for (int i = 0; i < 4; i++)
-    {
-        g_partial_sums[i] = 0.0;
-    }
     g_Lavg = 1.0;
+    g_lum.resize(total_pixels); // untouched; every thread writes its own part first
+
+    Topology topo = read_topology();
+    std::vector<int> cpus = placement_cpus(topo, policy, nthreads);
+    print_placement(topo, policy, cpus);
 
     printf("Initializing barrier...\n");
     // Create threads
-    for (int i = 0; i < 4; i++)
+    for (int i = 0; i < nthreads; i++)
     {
         td[i].id = i;
-        td[i].tc = 4;
-        td[i].start_pixel = (size_t)i * pixels_per_thread;
+        td[i].tc = nthreads;
+        td[i].start_pixel = std::min((size_t)i * pixels_per_thread, total_pixels);
         td[i].end_pixel = std::min((size_t)(i + 1) * pixels_per_thread, total_pixels);
         td[i].local_sense = 0;
-        td[i].use_sense = use_sense;
+        td[i].reduce_sense = 0;
+        td[i].mode = mode;
+        td[i].cpu = cpus[i];
+        td[i].pixel_file = pixel_file;
         td[i].img = img;
 
         threads[i] = std::thread(threadfct, &td[i]);
@@ -440,7 +1052,7 @@ static void tone_mapping(BMPImage24 *img, int use_sense)
 
     printf("Barrier initialized. Waiting for threads to complete...\n");
     // Join threads
-    for (int i = 0; i < 4; i++)
+    for (int i = 0; i < nthreads; i++)
     {
         threads[i].join();
     }
@@ -448,36 +1060,179 @@ static void tone_mapping(BMPImage24 *img, int use_sense)
     printf("Tone mapping completed.\n");
 }
 
+// barrier latency benchmark
+// every thread does `episodes` back-to-back barrier waits, reported as ns per episode
+static void bench_thread(int mode, int id, int episodes)
+{
+    int local_sense = 0;
+    for (int e = 0; e < episodes; e++)
+    {
+        gather(mode, id, &local_sense);
+    }
+}
+
+// allreduce column: same loop on g_reduce, each thread contributing its id
+static void bench_reduce_thread(int id, int episodes)
+{
+    int local_sense = 0;
+    double check = 0.0;
+    for (int e = 0; e < episodes; e++)
+    {
+        check = reduce_barrier_wait(&g_reduce, id, &local_sense, (double)id);
+    }
+    int n = g_reduce.tree.nthreads;
+    if (check != (double)n * (n - 1) / 2)
+    {
+        printf("allreduce mismatch on thread %d: %f\n", id, check);
+    }
+}
+
+static double bench_reduce(int nthreads, int episodes)
+{
+    reduce_barrier_init(&g_reduce, nthreads, reduce_sum);
+    std::vector<std::thread> threads;
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < nthreads; i++)
+    {
+        threads.emplace_back(bench_reduce_thread, i, episodes);
+    }
+    for (int i = 0; i < nthreads; i++)
+    {
+        threads[i].join();
+    }
+    auto t1 = std::chrono::steady_clock::now();
+
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+    return ns / episodes;
+}
+
+static double bench_barrier(int mode, int nthreads, int episodes)
+{
+    barrier_init(mode, nthreads);
+    std::vector<std::thread> threads;
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < nthreads; i++)
+    {
+        threads.emplace_back(bench_thread, mode, i, episodes);
+    }
+    for (int i = 0; i < nthreads; i++)
+    {
+        threads[i].join();
+    }
+    auto t1 = std::chrono::steady_clock::now();
+
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+    return ns / episodes;
+}
+
+static void barrier_bench(int max_threads, int episodes)
+{
+    printf("Barrier latency (ns per episode, %d episodes)\n", episodes);
+    printf("%8s", "threads");
+    for (int mode = 0; mode < SYNC_MODE_COUNT; mode++)
+    {
+        printf(" %16s", mode_name(mode));
+    }
+    printf(" %16s\n", "tree allreduce");
+
+    for (int t = 1; t <= max_threads; t *= 2)
+    {
+        printf("%8d", t);
+        for (int mode = 0; mode < SYNC_MODE_COUNT; mode++)
+        {
+            printf(" %16.0f", bench_barrier(mode, t, episodes));
+        }
+        printf(" %16.0f\n", bench_reduce(t, episodes));
+    }
+}
+
 static int parse_mode(int argc, char **argv)
 {
     if (argc >= 4)
     {
-        if (strcmp(argv[3], "sense") == 0)
+        if (strcmp(argv[3], "reduce") == 0)
+        {
+            return REDUCE_BARRIER;
+        }
+        else if (strcmp(argv[3], "sense") == 0)
         {
-            return 0;
+            return SENSE_REVERSING_BARRIER;
         }
         else if (strcmp(argv[3], "diy") == 0)
         {
-            return 1;
+            return DIY_GATE_BARRIER;
+        }
+        else if (strcmp(argv[3], "tree") == 0)
+        {
+            return TREE_BARRIER;
+        }
+        else if (strcmp(argv[3], "tournament") == 0)
+        {
+            return TOURNAMENT_BARRIER;
+        }
+        else if (strcmp(argv[3], "dissemination") == 0)
+        {
+            return DISSEMINATION_BARRIER;
         }
     }
-    return 1;
+    return REDUCE_BARRIER;
+}
+
+static int parse_threads(const char *arg)
+{
+    int n = atoi(arg);
+    if (n < 1)
+    {
+        n = 1;
+    }
+    if (n > MAX_THREADS)
+    {
+        n = MAX_THREADS;
+    }
+    return n;
 }
 
 int main(int argc, char **argv)
 {
+    // ./program topo
+    if (argc >= 2 && strcmp(argv[1], "topo") == 0)
+    {
+        placement_bandwidth_report(read_topology());
+        return 0;
+    }
+
+    // ./program bench [max_threads] [episodes]
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0)
+    {
+        int max_threads = (argc >= 3) ? parse_threads(argv[2]) : 64;
+        int episodes = (argc >= 4) ? atoi(argv[3]) : 10000;
+        barrier_bench(max_threads, episodes);
+        return 0;
+    }
+
     if (argc < 3)
     {
-        printf("Usage: %s <input.bmp> <output.bmp> [mode]\n", argv[0]);
+        printf("Usage: %s <input.bmp> <output.bmp> [reduce|sense|diy|tree|tournament|dissemination] [threads] [none|compact|scatter]\n", argv[0]);
+        printf("       reduce (default): stage 1 sums through the reducing barrier; a barrier name carries\n");
+        printf("       the partial sums through that barrier instead\n");
+        printf("       %s bench [max_threads] [episodes]\n", argv[0]);
+        printf("       %s topo\n", argv[0]);
+        return 1;
     }
 
-    int use_sense = parse_mode(argc, argv);
+    int mode = parse_mode(argc, argv);
+    int nthreads = (argc >= 5) ? parse_threads(argv[4]) : 4;
+    PlacementPolicy policy = (argc >= 6) ? parse_placement(argv[5]) : PLACE_NONE;
 
-    printf("Using %s barrier\n", (use_sense == 0) ? "sense reversing" : "DIY gate");
+    printf("Using %s barrier, %d threads\n", mode_name(mode), nthreads);
 
-    BMPImage24 img = load_bmp(argv[1]);
-    tone_mapping(&img, use_sense);
+    // with a placement policy the workers load (and so first-touch) their own pixels
+    int defer = (policy != PLACE_NONE);
+    BMPImage24 img = load_bmp(argv[1], defer);
+    tone_mapping(&img, mode, nthreads, policy, defer ? argv[1] : NULL);
     save_bmp(argv[2], &img);
     free_image(&img);
     return 0;
-}
\ No newline at end of file
+}
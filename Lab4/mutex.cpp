@@ -14,6 +14,11 @@
 #include <thread>
 #include <math.h>
 
+#include "../common/placement.h"
+#include "../common/spinlock.h"
+#include "../common/lockstat.h"
+#include "../common/stencil.h"
+
 #pragma pack(push, 1)
 struct BMPFileHeader
 {
@@ -49,10 +54,12 @@ struct BMPImage24
     int width = 0;
     int height = 0;
     int pre_height = 0;
-    std::vector<uint8_t> bgr; // BGR data
+    long data_offset = 0; // file offset of the pixel data (for deferred loads)
+    std::vector<uint8_t, no_init_allocator<uint8_t>> bgr; // BGR data
 };
 
-static BMPImage24 load_bmp(const char *filename)
+// defer_pixels: only read the headers and allocate bgr untouched (see place_image)
+static BMPImage24 load_bmp(const char *filename, int defer_pixels)
 {
     FILE *file = fopen(filename, "rb");
     if (!file)
@@ -89,6 +96,14 @@ static BMPImage24 load_bmp(const char *filename)
     int padding = row_padded(img.width);
     int image_bytes = padding * img.height;
     img.bgr.resize((size_t)image_bytes);
+    img.data_offset = (long)fh.bfOffBits;
+
+    if (defer_pixels)
+    {
+        fclose(file);
+        printf("BMP Image header loaded: %dx%d (pixels read by workers)\n", img.width, img.height);
+        return img;
+    }
 
     if (fseek(file, fh.bfOffBits, SEEK_SET) != 0)
     {
@@ -151,28 +166,63 @@ static void save_bmp(const char *filename, const BMPImage24 *img)
 /* mutex is a synchronization primitive that enforeces limit 
     on access to a shared resource when having multiple thread of execution 
 */ 
-typedef struct
-{
-    std::atomic_flag f;
-} lock_t;
-static void init(lock_t *m)
+// TTAS lock from common/spinlock.h, instrumented by common/lockstat.h with -DLOCK_STATS
+typedef STAT_LOCK(ttas_lock_t) lock_t;
+
+// NUMA-local first touch: each pinned thread reads its static row block of src from
+// the file and touches the same block of dst, so both land on that thread's node.
+// Rows are claimed dynamically later, but most of them stay on the same node.
+static void place_rows(const char *filename, BMPImage24 *src, BMPImage24 *dst, int cpu, int t, int nthreads)
 {
-    atomic_flag_clear(&m->f); // f=0
+    pin_thread(cpu);
+    size_t padding = (size_t)row_padded(src->width);
+    size_t r0, r1;
+    partition_range((size_t)src->height, nthreads, t, &r0, &r1);
+    size_t bytes = (r1 - r0) * padding;
+    if (bytes == 0)
+    {
+        return;
+    }
+    if (!read_file_range(filename, src->data_offset + (long)(r0 * padding), &src->bgr[r0 * padding], bytes))
+    {
+        printf("Can't read pixel data\n");
+        exit(EXIT_FAILURE);
+    }
+    first_touch(&dst->bgr[r0 * padding], bytes);
+    // the workers only write pixels, so carry each row's padding over as the copy did
+    size_t pixels = (size_t)src->width * 3;
+    for (size_t r = r0; r < r1; r++)
+    {
+        memcpy(&dst->bgr[r * padding + pixels], &src->bgr[r * padding + pixels], padding - pixels);
+    }
 }
-static void lock(lock_t *m) // t1t2
+
+static void place_image(const char *filename, BMPImage24 *src, BMPImage24 *dst, const std::vector<int> &cpus)
 {
-    while (atomic_flag_test_and_set(&m->f))
+    std::vector<std::thread> threads;
+    int nthreads = (int)cpus.size();
+    for (int t = 0; t < nthreads; t++)
+    {
+        threads.emplace_back(place_rows, filename, src, dst, cpus[t], t, nthreads);
+    }
+    for (int t = 0; t < nthreads; t++)
     {
-        // spin
+        threads[t].join();
     }
 }
-static void unlock(lock_t *m)
+
+// horizontal 7-wide box average, edge pixels average over the taps in the image
+struct Box7
 {
-    atomic_flag_clear(&m->f);
-}
+    static constexpr StencilTap taps[] = {{0, -3}, {0, -2}, {0, -1}, {0, 0}, {0, 1}, {0, 2}, {0, 3}};
+    static constexpr StencilGroup groups[] = {{1.0, 7}};
+    static constexpr int renormalize = 1;
+};
 
-void pworker(const BMPImage24 *src, BMPImage24 *dst, int *shared_row, lock_t *m)
+void pworker(const BMPImage24 *src, BMPImage24 *dst, int *shared_row, lock_t *m, int cpu, int id)
 {
+    pin_thread(cpu);
+    LOCKSTAT_THREAD(id);
     int width = src->width;
     int height = src->height;
     int padding = row_padded(width);
@@ -187,70 +237,129 @@ void pworker(const BMPImage24 *src, BMPImage24 *dst, int *shared_row, lock_t *m)
         }
         (*shared_row)++;
         unlock(m);
+        LOCKSTAT_CLAIM();
 
-        /* guassian horizontal blur :
-        p[i] = p[i] * 0.399050
-        + p[i +1] *(0.242036) + p[i +2] *(0.054005) + p[i +3] *(0.004433)
-        + p[i -1] *(0.242036) + p[i -2] *(0.054005) + p[i -3] *(0.004433);
-        */
-        // const double weights[] = {
-        //     0.399050,
-        //     0.242036,
-        //     0.054005,
-        //     0.004433
-        // };
-
-        for (int x = 0; x < width; x++){
-            double weight_count = 0.0;
-            double b = 0.0, g = 0.0, r = 0.0;
-
-            // offset
-            for (int c = -3; c <= 3; c++){
-                int neigh_x = x + c;
-
-                // check for corner/bound
-                if (neigh_x >= 0 && neigh_x < width)
-                {
-                    // int pixel_idx = (sr * padding) + (neigh_x * 3);
-                    // double weight_value = weights[abs(c)];
-                    // b += src->bgr[pixel_idx + 0] * weight_value;
-                    // g += src->bgr[pixel_idx + 1] * weight_value;
-                    // r += src->bgr[pixel_idx + 2] * weight_value;
-                    // weight_count += weight_value;
-                    int pixel_idx = (sr * padding) + (neigh_x * 3);
-                    // double weight_value = weights[abs(c)];
-                    b += src->bgr[pixel_idx + 0];
-                    g += src->bgr[pixel_idx + 1];
-                    r += src->bgr[pixel_idx + 2];
-                    weight_count++;
-                }
-            }
-            int out_res = (sr * padding) + (x * 3);
-            dst->bgr[out_res + 0] = b / weight_count;
-            dst->bgr[out_res + 1] = g / weight_count;
-            dst->bgr[out_res + 2] = r / weight_count;
-
-            if (sr == 100 && x == 100){
-                printf("total weight count: %f\n", weight_count);
-            }
-
+        stencil_row<Box7>(src->bgr.data(), padding, &dst->bgr[sr * padding], sr, width, height);
+        if (sr == 100 && width > 100){
+            printf("total weight count: %f\n", stencil_weight<Box7>());
         }
     }
 }
 
+// lock contention benchmark
+// every thread loops lock / shared++ / unlock for a fixed time. Reports total
+// acquisitions per second and fairness: Jain's index over the per-thread counts
+// (1.0 = perfectly even) and min/max thread count ratio.
+struct alignas(CACHE_LINE) BenchCount
+{
+    long long n = 0;
+};
+
+template <class L>
+static void bench_lock(const char *name, int nthreads, int ms)
+{
+    L m;
+    init(&m);
+    std::atomic<int> stop{0};
+    long long shared = 0;
+    std::vector<BenchCount> counts(nthreads);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++)
+    {
+        threads.emplace_back([&, t]()
+                             {
+                                 long long mine = 0;
+                                 while (!stop.load(std::memory_order_relaxed))
+                                 {
+                                     lock(&m);
+                                     shared++;
+                                     unlock(&m);
+                                     mine++;
+                                 }
+                                 counts[t].n = mine; });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    stop.store(1);
+    for (int t = 0; t < nthreads; t++)
+    {
+        threads[t].join();
+    }
+
+    double sum = 0.0, sumsq = 0.0;
+    long long lo = counts[0].n, hi = counts[0].n;
+    for (int t = 0; t < nthreads; t++)
+    {
+        double c = (double)counts[t].n;
+        sum += c;
+        sumsq += c * c;
+        lo = std::min(lo, counts[t].n);
+        hi = std::max(hi, counts[t].n);
+    }
+    double jain = (sumsq > 0) ? (sum * sum) / (nthreads * sumsq) : 1.0;
+    double minmax = (hi > 0) ? (double)lo / (double)hi : 1.0;
+
+    printf("%-8s %8d %16.0f %8.3f %8.3f%s\n", name, nthreads, sum / (ms / 1000.0), jain, minmax,
+           (shared == (long long)sum) ? "" : "  COUNT MISMATCH");
+}
+
+static void lock_bench(int max_threads, int ms)
+{
+    printf("%-8s %8s %16s %8s %8s\n", "lock", "threads", "acq/sec", "jain", "min/max");
+    for (int t = 1; t <= max_threads; t *= 2)
+    {
+        bench_lock<tas_lock_t>("tas", t, ms);
+        bench_lock<ttas_lock_t>("ttas", t, ms);
+        bench_lock<ticket_lock_t>("ticket", t, ms);
+        bench_lock<mcs_lock_t>("mcs", t, ms);
+        bench_lock<futex_lock_t>("futex", t, ms);
+    }
+}
+
 int main(int argc, char **argv)
 {
+    // ./mutex bench [max_threads] [ms_per_run]
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0)
+    {
+        int max_threads = (argc >= 3) ? atoi(argv[2]) : 64;
+        int ms = (argc >= 4) ? atoi(argv[3]) : 200;
+        lock_bench(max_threads, ms);
+        return 0;
+    }
+
     if (argc < 3)
     {
-        printf("Usage: %s <input.bmp> <output.bmp>\n", argv[0]);
+        printf("Usage: %s <input.bmp> <output.bmp> [none|compact|scatter]\n", argv[0]);
+        printf("       %s bench [max_threads] [ms_per_run]\n", argv[0]);
         return 1;
     }
 
     const char *input_bmp = argv[1];
     const char *output_bmp = argv[2];
 
-    BMPImage24 img = load_bmp(input_bmp);
-    BMPImage24 out_img = img;
+    PlacementPolicy policy = (argc >= 4) ? parse_placement(argv[3]) : PLACE_NONE;
+    int num_workers = 4;
+
+    Topology topo = read_topology();
+    std::vector<int> cpus = placement_cpus(topo, policy, num_workers);
+    print_placement(topo, policy, cpus);
+
+    // with a placement policy the pinned workers read / first-touch the pixels themselves
+    int defer = (policy != PLACE_NONE);
+    BMPImage24 img = load_bmp(input_bmp, defer);
+    BMPImage24 out_img;
+    out_img.width = img.width;
+    out_img.height = img.height;
+    out_img.pre_height = img.pre_height;
+    out_img.bgr.resize(img.bgr.size());
+    if (defer)
+    {
+        place_image(input_bmp, &img, &out_img, cpus);
+    }
+    else
+    {
+        out_img.bgr = img.bgr;
+    }
 
     int shared_row = 0;
     lock_t m;
@@ -259,10 +368,9 @@ int main(int argc, char **argv)
     // creating worker threads
     // emplace_back appends new element to the end of container
     std::vector<std::thread> workers;
-    int num_workers = 4;
     for (int i = 0; i < num_workers; i++)
     {
-        workers.emplace_back(pworker, &img, &out_img, &shared_row, &m);
+        workers.emplace_back(pworker, &img, &out_img, &shared_row, &m, cpus[i], i);
     }
 
     for (int i = 0; i < num_workers; i++){
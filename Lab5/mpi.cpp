@@ -13,6 +13,10 @@
 #include <math.h>
 #include <mpi.h> //mpiexec
 
+#include "../common/mpi_slab.h"
+#include "../common/mpi_sched.h"
+#include "../common/pointop.h"
+
 #pragma pack(push, 1)
 struct BMPFileHeader
 {
@@ -48,10 +52,12 @@ struct BMPImage24
     int width = 0;
     int height = 0;
     int pre_height = 0;
+    long data_offset = 0; // file offset of the pixel data
     std::vector<uint8_t> bgr; // BGR data
 };
 
-static BMPImage24 load_bmp(const char *filename)
+// header_only: stop after the headers (pixels are read per rank with MPI-IO)
+static BMPImage24 load_bmp(const char *filename, int header_only)
 {
     FILE *file = fopen(filename, "rb");
     if (!file)
@@ -84,6 +90,14 @@ static BMPImage24 load_bmp(const char *filename)
     img.width = ih.biWidth;
     img.height = (ih.biHeight > 0) ? ih.biHeight : -ih.biHeight;
     img.pre_height = ih.biHeight;
+    img.data_offset = (long)fh.bfOffBits;
+
+    if (header_only)
+    {
+        fclose(file);
+        printf("BMP Header loaded: %dx%d\n", img.width, img.height);
+        return img;
+    }
 
     int padding = row_padded(img.width);
     int image_bytes = padding * img.height;
@@ -107,7 +121,37 @@ static BMPImage24 load_bmp(const char *filename)
     return img;
 }
 
-static void save_bmp(const char *filename, const BMPImage24 *img)
+// file + info header in front of the pixel data (54 bytes)
+struct BMPHeaders
+{
+    BMPFileHeader fh;
+    BMPInfoHeader ih;
+};
+
+static BMPHeaders make_bmp_headers(const BMPImage24 *img)
+{
+    int width = img->width;
+    int height = img->height;
+    int padding = row_padded(width);
+
+    BMPHeaders h;
+    memset(&h, 0, sizeof(h));
+    h.fh.bfType = 0x4D42;
+    h.fh.bfOffBits = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
+    h.fh.bfSize = h.fh.bfOffBits + (unsigned int)(padding * height);
+
+    h.ih.biSize = sizeof(BMPInfoHeader);
+    h.ih.biWidth = width;
+    h.ih.biHeight = img->pre_height;
+    h.ih.biPlanes = 1;
+    h.ih.biBitCount = 24;
+    h.ih.biCompression = 0;
+    h.ih.biSizeImage = (unsigned int)(padding * height);
+    return h;
+}
+
+// pixels: img->height rows of row_padded(width) bytes, e.g. a shared window
+static void save_bmp_pixels(const char *filename, const BMPImage24 *img, const uint8_t *pixels)
 {
     FILE *file = fopen(filename, "wb");
     if (!file)
@@ -120,32 +164,175 @@ static void save_bmp(const char *filename, const BMPImage24 *img)
         printf("Saving file: %s\n", filename);
     }
 
-    int width = img->width;
-    int height = img->height;
-    int padding = row_padded(width);
-
-    struct BMPFileHeader fh;
-    memset(&fh, 0, sizeof(fh));
-    fh.bfType = 0x4D42;
-    fh.bfOffBits = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
-    fh.bfSize = fh.bfOffBits + (unsigned int)(padding * height);
-
-    struct BMPInfoHeader ih;
-    memset(&ih, 0, sizeof(ih));
-    ih.biSize = sizeof(BMPInfoHeader);
-    ih.biWidth = width;
-    ih.biHeight = img->pre_height;
-    ih.biPlanes = 1;
-    ih.biBitCount = 24;
-    ih.biCompression = 0;
-    ih.biSizeImage = (unsigned int)(padding * height);
-
-    fwrite(&fh, sizeof(fh), 1, file);
-    fwrite(&ih, sizeof(ih), 1, file);
-    fwrite(img->bgr.data(), 1, img->bgr.size(), file);
+    BMPHeaders h = make_bmp_headers(img);
+    fwrite(&h.fh, sizeof(h.fh), 1, file);
+    fwrite(&h.ih, sizeof(h.ih), 1, file);
+    fwrite(pixels, 1, (size_t)row_padded(img->width) * img->height, file);
     fclose(file);
 }
 
+static void save_bmp(const char *filename, const BMPImage24 *img)
+{
+    save_bmp_pixels(filename, img, img->bgr.data());
+}
+
+// --flag anywhere after the positional arguments
+static int has_flag(int argc, char **argv, const char *flag)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], flag) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// --flag <int>, or def when absent
+static int flag_int(int argc, char **argv, const char *flag, int def)
+{
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], flag) == 0)
+        {
+            return atoi(argv[i + 1]);
+        }
+    }
+    return def;
+}
+
+// B + G + R over `rows` rows
+static long long rows_sum(const unsigned char *rows, int n, int width, int padding)
+{
+    long long sum = 0;
+    for (int i = 0; i < n; i++){
+        for (int x = 0; x < width; x++){
+            int index = (i * padding) + (x * 3);
+            unsigned char B = rows[index];
+            unsigned char G = rows[index + 1];
+            unsigned char R = rows[index + 2];
+            sum += (B + G + R);
+        }
+    }
+    return sum;
+}
+
+// global sum on rank 0 -> avg / 128 on every rank
+static double global_avg(long long lsum, const BMPImage24 *img, long long *gsum)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    *gsum = 0;
+    MPI_Reduce(&lsum, gsum, 1, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    double avg = 0.0;
+    if (rank == 0){
+        avg = *gsum / (img->width * img->height * 3);
+        printf("global sum: %lld, avg: %f\n", *gsum, avg);
+        avg = avg / 128.0; 
+    }
+
+    MPI_Bcast(&avg, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    return avg;
+}
+
+// dot product
+// (B,G,R) *= (0.9 * avg,0.8*avg, 1.0*avg), one table per channel
+// (& 0xFF keeps the wrap the old (unsigned char) cast gave on bright images)
+static void make_scale(PointOp *scale, double avg)
+{
+    pointop_identity(scale);
+    pointop_map(scale, 0, [&](int b) { return (int)(b * (0.9 * avg)) & 0xFF; });
+    pointop_map(scale, 1, [&](int g) { return (int)(g * (0.8 * avg)) & 0xFF; });
+    pointop_map(scale, 2, [&](int r) { return (int)(r * (1.0 * avg)) & 0xFF; });
+}
+
+// --dynamic: rank 0 deals out guided row chunks on demand, workers keep theirs for
+// the scale pass and send them back once avg is known (each row crosses the network
+// once each way, like scatter / gather)
+static void run_dynamic(const char *output_bmp, BMPImage24 *img, int min_rows, int slow_rank)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    int padding = row_padded(img->width);
+    double busy = 0.0;
+
+    std::vector<std::vector<RowChunk>> log;
+    std::vector<RowChunk> mine;
+    std::vector<std::vector<unsigned char>> rows;
+    long long lsum = 0;
+    if (rank == 0)
+    {
+        sched_serve(
+            0, img->height, min_rows,
+            [&](int w, RowChunk c) {
+                MPI_Send(img->bgr.data() + (size_t)c.start * padding, c.count * padding, MPI_UNSIGNED_CHAR, w, TAG_SCHED_ROWS, MPI_COMM_WORLD);
+            },
+            [&](int, RowChunk) {}, &log);
+    }
+    else
+    {
+        RowChunk done = {0, 0}, next;
+        while (sched_request(0, &done, &next, [](RowChunk) {}))
+        {
+            rows.emplace_back((size_t)next.count * padding);
+            MPI_Recv(rows.back().data(), next.count * padding, MPI_UNSIGNED_CHAR, 0, TAG_SCHED_ROWS, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            mine.push_back(next);
+
+            double t0 = MPI_Wtime();
+            lsum += rows_sum(rows.back().data(), next.count, img->width, padding);
+            slow_down(slow_rank, t0);
+            busy += MPI_Wtime() - t0;
+        }
+    }
+
+    long long gsum;
+    double avg = global_avg(lsum, img, &gsum);
+
+    if (rank == 0)
+    {
+        // chunks come back per worker in the order they were handed out
+        for (size_t w = 1; w < log.size(); w++)
+        {
+            for (const RowChunk &c : log[w])
+            {
+                MPI_Recv(img->bgr.data() + (size_t)c.start * padding, c.count * padding, MPI_UNSIGNED_CHAR, (int)w, TAG_SCHED_ROWS, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            }
+        }
+    }
+    else
+    {
+        double t0 = MPI_Wtime();
+        PointOp scale;
+        make_scale(&scale, avg);
+        for (size_t k = 0; k < mine.size(); k++)
+        {
+            pointop_apply(&scale, rows[k].data(), mine[k].count, img->width, padding);
+        }
+        slow_down(slow_rank, t0);
+        busy += MPI_Wtime() - t0;
+
+        for (size_t k = 0; k < mine.size(); k++)
+        {
+            MPI_Send(rows[k].data(), mine[k].count * padding, MPI_UNSIGNED_CHAR, 0, TAG_SCHED_ROWS, MPI_COMM_WORLD);
+        }
+    }
+
+    report_imbalance("dynamic rows (workers)", busy, 1);
+    if (rank == 0)
+    {
+        size_t chunks = 0;
+        for (size_t w = 1; w < log.size(); w++)
+        {
+            printf("  rank %zu: %zu chunks\n", w, log[w].size());
+            chunks += log[w].size();
+        }
+        printf("sum=%lld (%zu chunks, min %d rows)\n", gsum, chunks, min_rows);
+        save_bmp(output_bmp, img);
+    }
+}
+
 int main(int argc, char **argv)
 {
     MPI_Init(&argc, &argv);
@@ -158,7 +345,7 @@ int main(int argc, char **argv)
 
     if (argc < 3)
     {
-        printf("Usage: mpi exec -n <n> ./mpi.exe worker <input.bmp> <output.bmp>\n", argv[0]);
+        printf("Usage: mpi exec -n <n> ./mpi.exe worker <input.bmp> <output.bmp> [--mpiio | --shm | --dynamic [--chunk rows]] [--slow rank]\n", argv[0]);
         MPI_Finalize();
         return 1;
     }
@@ -166,15 +353,67 @@ int main(int argc, char **argv)
     const char *input_bmp = argv[1];
     const char *output_bmp = argv[2];
 
-    BMPImage24 img = load_bmp(input_bmp);
-    int padding = row_padded(img.width);
+    // --mpiio: rank 0 reads only the headers, every rank reads / writes its own rows
+    int use_mpiio = has_flag(argc, argv, "--mpiio");
+
+    // --shm: one shared window holds the image, ranks work on their rows in place.
+    // Only when every rank is on this host, otherwise fall back to scatter/gather.
+    int use_shm = has_flag(argc, argv, "--shm");
+    if (use_shm && !shm_single_node())
+    {
+        if (rank == 0)
+            printf("--shm: ranks span several nodes, using scatter/gather\n");
+        use_shm = 0;
+    }
+    if (use_shm)
+    {
+        use_mpiio = 0;
+    }
+
+    // --dynamic: rank 0 only schedules, rows go to whoever asks next
+    int use_dynamic = has_flag(argc, argv, "--dynamic");
+    int min_rows = flag_int(argc, argv, "--chunk", 4);
+    int slow_rank = flag_int(argc, argv, "--slow", -1);
+    if (use_dynamic && nprocs < 2)
+    {
+        if (rank == 0)
+            printf("--dynamic needs a master and at least one worker, using static rows\n");
+        use_dynamic = 0;
+    }
+    if (use_dynamic)
+    {
+        use_mpiio = 0;
+        use_shm = 0;
+    }
+
+    double io_start = MPI_Wtime();
+    BMPImage24 img;
+    if (!use_mpiio && !use_shm && !use_dynamic)
+    {
+        img = load_bmp(input_bmp, 0);
+    }
+    else if (rank == 0)
+    {
+        img = load_bmp(input_bmp, !use_dynamic);
+    }
 
     MPI_Bcast(&img.width, 1, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(&img.height, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&img.pre_height, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&img.data_offset, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+    int padding = row_padded(img.width);
+
+    if (use_dynamic)
+    {
+        run_dynamic(output_bmp, &img, min_rows, slow_rank);
+        MPI_Finalize();
+        return 0;
+    }
 
     const int N = img.height;
     int base = N / nprocs, rem = N % nprocs;
     int nloc = base + (rank < rem);
+    int start_row = rank * base + (rank < rem ? rank : rem);
 
     int *counts = 0, *displs = 0;
     if (rank == 0)
@@ -196,10 +435,33 @@ int main(int argc, char **argv)
         }
     }
 
-    // allocate mem for loc chunk
-    unsigned char *loc = (unsigned char *)malloc(nloc * padding);
+    // allocate mem for loc chunk (or point it at this rank's rows of the shared image)
+    ShmImage shm;
+    unsigned char *loc;
+    if (use_shm)
+    {
+        shm_alloc((MPI_Aint)N * padding, &shm);
+        if (rank == 0)
+        {
+            read_pixels(input_bmp, img.data_offset, shm.base, (size_t)N * padding);
+        }
+        MPI_Win_fence(0, shm.win);
+        loc = shm.base + (size_t)start_row * padding;
+    }
+    else
+    {
+        loc = (unsigned char *)malloc(nloc * padding);
+    }
 
-    MPI_Scatterv(img.bgr.data(), counts, displs, MPI_UNSIGNED_CHAR, loc, nloc * padding, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+    if (use_mpiio)
+    {
+        mpiio_read_rows(input_bmp, img.data_offset, padding, start_row, nloc, loc);
+    }
+    else if (!use_shm)
+    {
+        MPI_Scatterv(img.bgr.data(), counts, displs, MPI_UNSIGNED_CHAR, loc, nloc * padding, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+    }
+    double io_read = MPI_Wtime() - io_start; // load + distribute
 
     // for (int i = 0; i < nloc; i++)
     //     loc[i]++;
@@ -209,57 +471,70 @@ int main(int argc, char **argv)
     MPI_Barrier(MPI_COMM_WORLD); // barrier between phases
 
     // avg illuminance
-    long long lsum = 0;
-    for (int i = 0; i < nloc; i++){
-        for (int x = 0; x < img.width; x++){
-            int index = (i * padding) + (x * 3);
-            unsigned char B = loc[index];
-            unsigned char G = loc[index + 1];
-            unsigned char R = loc[index + 2];
-            lsum += (B + G + R);
+    double busy_start = MPI_Wtime();
+    long long lsum = rows_sum(loc, nloc, img.width, padding);
+    slow_down(slow_rank, busy_start);
+    double busy = MPI_Wtime() - busy_start;
+
+    long long gsum;
+    double avg = global_avg(lsum, &img, &gsum);
+
+    double op_start = MPI_Wtime();
+    PointOp scale;
+    make_scale(&scale, avg);
+    pointop_apply(&scale, loc, nloc, img.width, padding);
+    slow_down(slow_rank, op_start);
+    double op_time = MPI_Wtime() - op_start;
+    busy += op_time;
+
+    io_start = MPI_Wtime();
+    if (use_shm)
+    {
+        MPI_Win_fence(0, shm.win);
+        if (rank == 0)
+        {
+            save_bmp_pixels(output_bmp, &img, shm.base);
         }
     }
-
-    long long gsum = 0;
-    MPI_Reduce(&lsum, &gsum, 1, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
-
-    double avg = 0.0;
-    if (rank == 0){
-        avg = gsum / (img.width * img.height * 3);
-        printf("global sum: %lld, avg: %f\n", gsum, avg);
-        avg = avg / 128.0; 
+    else if (use_mpiio)
+    {
+        BMPHeaders h = make_bmp_headers(&img);
+        mpiio_write_rows(output_bmp, &h, (int)sizeof(h), N, padding, start_row, nloc, loc);
     }
-
-    MPI_Bcast(&avg, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-
-    // dot product
-    // (B,G,R) *= (0.9 * avg,0.8*avg, 1.0*avg)
-    for (int i = 0; i < nloc; i++){
-        for (int x = 0; x < img.width; x++){
-            int index = (i * padding) + (x * 3);
-            double b = loc[index];
-            double g = loc[index + 1];
-            double r = loc[index + 2];
-
-            b *= (0.9 * avg);
-            g *= (0.8 * avg);
-            r *= (1.0 * avg);
-
-            loc[index + 0] = (unsigned char)b;
-            loc[index + 1] = (unsigned char)g;
-            loc[index + 2] = (unsigned char)r;
+    else
+    {
+        MPI_Gatherv(loc, nloc * padding, MPI_UNSIGNED_CHAR, img.bgr.data(), counts, displs, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+        if (rank == 0)
+        {
+            save_bmp(output_bmp, &img);
         }
     }
+    double io_write = MPI_Wtime() - io_start;
 
-    MPI_Gatherv(loc, nloc * padding, MPI_UNSIGNED_CHAR, img.bgr.data(), counts, displs, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+    double io_max[3], io_local[3] = {io_read, io_write, op_time};
+    MPI_Reduce(io_local, io_max, 3, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    report_imbalance("static rows", busy, 0);
 
     if (rank == 0)
+    {
         printf("sum=%lld\n", gsum);
+        double mb = (double)N * padding / 1e6;
+        printf("%s: read %.4f s (%.1f MB/s), write %.4f s (%.1f MB/s)\n",
+               use_shm ? "shared window" : (use_mpiio ? "MPI-IO" : "scatter/gather"),
+               io_max[0], mb / io_max[0], io_max[1], mb / io_max[1]);
+        printf("colour scale (LUT): %.4f s (%.1f MB/s per rank)\n", io_max[2], mb / nprocs / io_max[2]);
+    }
 
-    free(loc);
+    if (use_shm)
+    {
+        shm_free(&shm);
+    }
+    else
+    {
+        free(loc);
+    }
     if (rank == 0)
     {
-        save_bmp(output_bmp, &img);
         free(counts);
         free(displs);
     }
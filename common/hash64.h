@@ -0,0 +1,118 @@
+// hash64.h
+// fast 64-bit non-cryptographic hash over a byte range (cache keys in spawn)
+//
+//   uint64_t seed = hash64(&params, sizeof(params), 0);   // what was done
+//   uint64_t key = hash64(pixels, bytes, seed);           // to which bytes
+//
+// xxHash64: four independent 8-byte lanes per 32-byte step, so a megabyte of image
+// costs well under a millisecond. Words are read in host byte order: keys are only
+// comparable between hosts of the same endianness. Not for anything adversarial.
+
+#ifndef HASH64_H
+#define HASH64_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define HASH64_P1 11400714785074694791ULL
+#define HASH64_P2 14029467366897019727ULL
+#define HASH64_P3 1609587929392839161ULL
+#define HASH64_P4 9650029242287828579ULL
+#define HASH64_P5 2870177450012600261ULL
+
+static inline uint64_t hash64_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash64_read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash64_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash64_round(uint64_t acc, uint64_t in)
+{
+    acc += in * HASH64_P2;
+    acc = hash64_rotl(acc, 31);
+    return acc * HASH64_P1;
+}
+
+static inline uint64_t hash64_merge(uint64_t acc, uint64_t lane)
+{
+    acc ^= hash64_round(0, lane);
+    return acc * HASH64_P1 + HASH64_P4;
+}
+
+static inline uint64_t hash64(const void *data, size_t len, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32)
+    {
+        uint64_t v1 = seed + HASH64_P1 + HASH64_P2;
+        uint64_t v2 = seed + HASH64_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - HASH64_P1;
+        const uint8_t *limit = end - 32;
+        do
+        {
+            v1 = hash64_round(v1, hash64_read64(p));
+            v2 = hash64_round(v2, hash64_read64(p + 8));
+            v3 = hash64_round(v3, hash64_read64(p + 16));
+            v4 = hash64_round(v4, hash64_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = hash64_rotl(v1, 1) + hash64_rotl(v2, 7) + hash64_rotl(v3, 12) + hash64_rotl(v4, 18);
+        h = hash64_merge(h, v1);
+        h = hash64_merge(h, v2);
+        h = hash64_merge(h, v3);
+        h = hash64_merge(h, v4);
+    }
+    else
+    {
+        h = seed + HASH64_P5;
+    }
+    h += (uint64_t)len;
+
+    // the tail: 8, then 4, then single bytes
+    while (p + 8 <= end)
+    {
+        h ^= hash64_round(0, hash64_read64(p));
+        h = hash64_rotl(h, 27) * HASH64_P1 + HASH64_P4;
+        p += 8;
+    }
+    if (p + 4 <= end)
+    {
+        h ^= (uint64_t)hash64_read32(p) * HASH64_P1;
+        h = hash64_rotl(h, 23) * HASH64_P2 + HASH64_P3;
+        p += 4;
+    }
+    while (p < end)
+    {
+        h ^= (uint64_t)(*p) * HASH64_P5;
+        h = hash64_rotl(h, 11) * HASH64_P1;
+        p++;
+    }
+
+    // avalanche
+    h ^= h >> 33;
+    h *= HASH64_P2;
+    h ^= h >> 29;
+    h *= HASH64_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+#endif
@@ -0,0 +1,176 @@
+// jobframe.h
+// framed jobs between the spawn coordinator and its calc workers (Asgn1)
+//
+// Every message starts with a fixed FRAME_BYTES header in network order. The first
+// word carries FRAME_VERSION next to the type, so both ends refuse a peer built
+// from a different protocol instead of misreading it. JOB frames are followed by
+// halo_top + rows + halo_bottom padded BMP rows of `width` pixels, RESULT frames by
+// `rows` rows.
+//
+//   HELLO     worker -> coordinator, once after connecting: job = worker id,
+//             param[0] = mask of the ops it runs (1 << OP_*), param[1] = 1 if the
+//             worker mapped the coordinator's shared image
+//   JOB       coordinator -> worker: apply `op` with `param` to the rows
+//   RESULT    worker -> coordinator: same job id, the processed rows (halo dropped)
+//   SHM_JOB   like JOB, but the rows stay in the shared image at `start_row`;
+//             nothing follows the header. Point ops only (no halo): a stencil
+//             would read rows another worker is changing in place
+//   SHM_DONE  the rows were processed in place; nothing follows
+//   STATS     worker -> coordinator, answering an OP_HISTOGRAM job (JOB or
+//             SHM_JOB): FRAME_HIST_BYTES of counts follow
+//   APPLY     coordinator -> worker: like JOB, but on the rows the worker kept
+//             from histogram job `job`; nothing follows, RESULT answers
+//   QUIT      coordinator -> worker: leave the job loop and exit
+//
+// Ops and their params (doubles travel as two words, high word first):
+//
+//   OP_CONTRAST  param[0] = contrast in [-255, 255]
+//   OP_BALANCE   param[0..2] = B, G, R gains in 1/65536 (x * gain rounded to
+//                nearest, clamped)
+//   OP_BLUR      param[0] = passes of the 7-tap gaussian (horizontal, then
+//                vertical); halo = OP_BLUR_REACH rows per pass
+//   OP_TONEMAP   param[0..1] = key, param[2..3] = log-average luminance of the
+//                whole image (Reinhard, as in Lab3)
+//   OP_HISTOGRAM param[0] = image tag. Counts of every byte value per channel,
+//                3 x 256 words (B, G, R); over the socket the worker keeps the rows
+//                for an APPLY, until a histogram job with another tag comes in
+//   OP_STRETCH   param[0] = lo, param[1] = hi: (x - lo) * 255 / (hi - lo), clamped
+//
+// Auto contrast takes two round trips: OP_HISTOGRAM over every chunk, then the
+// coordinator merges the counts into lo / hi and sends OP_STRETCH as APPLY frames
+// to the workers that still hold the rows, so pixels cross the socket once each way.
+//
+// Stencil ops get halo_top / halo_bottom extra rows around the rows they answer
+// for; fewer than the op's reach means the image ends there.
+//
+// Workers stay connected between jobs, so a stream of images pays process start
+// and connection setup once per pool instead of once per image. Local workers get
+// SHM_JOB / SHM_DONE for point ops, so the socket carries a header per job instead
+// of the rows twice; workers on other hosts keep JOB / RESULT.
+
+#ifndef JOBFRAME_H
+#define JOBFRAME_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define FRAME_VERSION 2
+
+#define FRAME_HELLO 1
+#define FRAME_JOB 2
+#define FRAME_RESULT 3
+#define FRAME_QUIT 4
+#define FRAME_SHM_JOB 5
+#define FRAME_SHM_DONE 6
+#define FRAME_STATS 7
+#define FRAME_APPLY 8
+
+#define OP_CONTRAST 1
+#define OP_BALANCE 2
+#define OP_BLUR 3
+#define OP_TONEMAP 4
+#define OP_HISTOGRAM 5
+#define OP_STRETCH 6
+
+#define OP_BLUR_REACH 3 // rows the gaussian reads above / below, per pass
+
+#define FRAME_PARAMS 4
+#define FRAME_BYTES 48
+#define FRAME_HIST_BYTES (3 * 256 * 4)
+
+struct JobFrame
+{
+    uint32_t version;
+    uint32_t type;
+    uint32_t job;
+    uint32_t op;
+    uint32_t rows;
+    uint32_t width;
+    uint32_t start_row;   // first answered row in the image
+    uint32_t halo_top;    // JOB: rows sent above start_row
+    uint32_t halo_bottom; // JOB: rows sent below the answered ones
+    int32_t param[FRAME_PARAMS];
+};
+
+static inline void frame_put(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline uint32_t frame_get(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void frame_pack(const JobFrame *f, uint8_t *out)
+{
+    frame_put(out + 0, (f->version << 16) | (f->type & 0xffff));
+    frame_put(out + 4, f->job);
+    frame_put(out + 8, f->op);
+    frame_put(out + 12, f->rows);
+    frame_put(out + 16, f->width);
+    frame_put(out + 20, f->start_row);
+    frame_put(out + 24, f->halo_top);
+    frame_put(out + 28, f->halo_bottom);
+    for (int i = 0; i < FRAME_PARAMS; i++)
+    {
+        frame_put(out + 32 + 4 * i, (uint32_t)f->param[i]);
+    }
+}
+
+static inline void frame_unpack(const uint8_t *in, JobFrame *f)
+{
+    uint32_t w = frame_get(in + 0);
+    f->version = w >> 16;
+    f->type = w & 0xffff;
+    f->job = frame_get(in + 4);
+    f->op = frame_get(in + 8);
+    f->rows = frame_get(in + 12);
+    f->width = frame_get(in + 16);
+    f->start_row = frame_get(in + 20);
+    f->halo_top = frame_get(in + 24);
+    f->halo_bottom = frame_get(in + 28);
+    for (int i = 0; i < FRAME_PARAMS; i++)
+    {
+        f->param[i] = (int32_t)frame_get(in + 32 + 4 * i);
+    }
+}
+
+// a frame of this protocol version with everything else zero
+static inline JobFrame frame_make(uint32_t type, uint32_t job)
+{
+    JobFrame f;
+    memset(&f, 0, sizeof(f));
+    f.version = FRAME_VERSION;
+    f.type = type;
+    f.job = job;
+    return f;
+}
+
+// a double in two param words, e.g. frame_put_double(f.param + 2, lavg)
+static inline void frame_put_double(int32_t *param, double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    param[0] = (int32_t)(uint32_t)(bits >> 32);
+    param[1] = (int32_t)(uint32_t)bits;
+}
+
+static inline double frame_get_double(const int32_t *param)
+{
+    uint64_t bits = ((uint64_t)(uint32_t)param[0] << 32) | (uint32_t)param[1];
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+// rows a stencil op reads beyond the ones it answers for, each side
+static inline int frame_op_halo(uint32_t op, const int32_t *param)
+{
+    return (op == OP_BLUR) ? OP_BLUR_REACH * (param[0] > 0 ? param[0] : 0) : 0;
+}
+
+#endif
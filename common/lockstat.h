@@ -0,0 +1,257 @@
+// lockstat.h
+// optional lock contention instrumentation, build with -DLOCK_STATS
+//
+//   typedef STAT_LOCK(ttas_lock_t) lock_t;   // instrumented only with LOCK_STATS
+//   LOCKSTAT_THREAD(i);                       // name the calling worker (per-thread rows)
+//   LOCKSTAT_CLAIM();                         // count one row / column claimed
+//
+// Each acquisition records spin iterations, wait cycles (lock() entry to acquired)
+// and hold cycles (acquired to unlock()) into log2 histograms owned by the calling
+// thread, so the hot path only writes thread_local data. When a thread exits its
+// histograms are merged into a global table under a mutex, and the summary is
+// printed at process exit. Without LOCK_STATS everything above compiles to nothing.
+
+#ifndef LOCKSTAT_H
+#define LOCKSTAT_H
+
+#include "spinlock.h"
+
+#ifndef LOCK_STATS
+
+#define STAT_LOCK(L) L
+#define LOCKSTAT_THREAD(id) ((void)(id))
+#define LOCKSTAT_CLAIM() ((void)0)
+
+#else
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#include <x86intrin.h>
+#endif
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#define LOCKSTAT_BUCKETS 64
+
+// cycle counter (ns on non-x86)
+static inline uint64_t lockstat_now()
+{
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+    return __rdtsc();
+#else
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+}
+
+// later - earlier, 0 if the counter went backwards (the TSC of another core after
+// a migration) instead of a wrapped value near 2^64
+static inline uint64_t lockstat_delta(uint64_t earlier, uint64_t later)
+{
+    return (later > earlier) ? later - earlier : 0;
+}
+
+// bucket b holds values in [2^(b-1), 2^b), bucket 0 holds 0; the last bucket also
+// takes everything from 2^(LOCKSTAT_BUCKETS - 2) up
+static inline int lockstat_bucket(uint64_t v)
+{
+    int b = 0;
+    while (v && b < LOCKSTAT_BUCKETS - 1)
+    {
+        b++;
+        v >>= 1;
+    }
+    return b;
+}
+
+struct LockStats
+{
+    uint64_t acquisitions = 0;
+    uint64_t contended = 0; // acquisitions that had to spin at least once
+    uint64_t contended_cycles = 0;
+    uint64_t wait_cycles = 0;
+    uint64_t hold_cycles = 0;
+    uint64_t spins = 0;
+    uint64_t claims = 0;
+    uint64_t wait_hist[LOCKSTAT_BUCKETS] = {0};
+    uint64_t hold_hist[LOCKSTAT_BUCKETS] = {0};
+    uint64_t spin_hist[LOCKSTAT_BUCKETS] = {0};
+
+    void merge(const LockStats &o)
+    {
+        acquisitions += o.acquisitions;
+        contended += o.contended;
+        contended_cycles += o.contended_cycles;
+        wait_cycles += o.wait_cycles;
+        hold_cycles += o.hold_cycles;
+        spins += o.spins;
+        claims += o.claims;
+        for (int b = 0; b < LOCKSTAT_BUCKETS; b++)
+        {
+            wait_hist[b] += o.wait_hist[b];
+            hold_hist[b] += o.hold_hist[b];
+            spin_hist[b] += o.spin_hist[b];
+        }
+    }
+};
+
+// upper bound of the bucket holding the p-th percentile
+static inline uint64_t lockstat_percentile(const uint64_t *hist, uint64_t total, double p)
+{
+    if (total == 0)
+    {
+        return 0;
+    }
+    uint64_t target = (uint64_t)(p * (double)total);
+    uint64_t seen = 0;
+    for (int b = 0; b < LOCKSTAT_BUCKETS; b++)
+    {
+        seen += hist[b];
+        if (seen > target)
+        {
+            return (b == 0) ? 0 : ((uint64_t)1 << b);
+        }
+    }
+    return (uint64_t)1 << (LOCKSTAT_BUCKETS - 1);
+}
+
+// merged per-worker-id stats, printed when the process exits
+struct LockStatRegistry
+{
+    std::mutex mu;
+    std::vector<LockStats> per_thread; // index = LOCKSTAT_THREAD id
+    LockStats unnamed;                 // threads that never called LOCKSTAT_THREAD
+
+    void add(int id, const LockStats &st)
+    {
+        std::lock_guard<std::mutex> g(mu);
+        if (id < 0)
+        {
+            unnamed.merge(st);
+            return;
+        }
+        if ((size_t)id >= per_thread.size())
+        {
+            per_thread.resize((size_t)id + 1);
+        }
+        per_thread[id].merge(st);
+    }
+
+    ~LockStatRegistry()
+    {
+        LockStats all = unnamed;
+        for (const LockStats &st : per_thread)
+        {
+            all.merge(st);
+        }
+        if (all.acquisitions == 0)
+        {
+            return;
+        }
+
+        long pid = 0;
+#ifdef __linux__
+        pid = (long)getpid();
+#endif
+        printf("[lockstat %ld] acquisitions %llu, contended %llu (%.1f%%), contended cycles %llu\n", pid,
+               (unsigned long long)all.acquisitions, (unsigned long long)all.contended,
+               100.0 * all.contended / all.acquisitions, (unsigned long long)all.contended_cycles);
+        printf("[lockstat %ld] wait cycles p50 <= %llu p99 <= %llu, hold cycles p50 <= %llu p99 <= %llu, spins p99 <= %llu\n", pid,
+               (unsigned long long)lockstat_percentile(all.wait_hist, all.acquisitions, 0.50),
+               (unsigned long long)lockstat_percentile(all.wait_hist, all.acquisitions, 0.99),
+               (unsigned long long)lockstat_percentile(all.hold_hist, all.acquisitions, 0.50),
+               (unsigned long long)lockstat_percentile(all.hold_hist, all.acquisitions, 0.99),
+               (unsigned long long)lockstat_percentile(all.spin_hist, all.acquisitions, 0.99));
+        printf("[lockstat %ld] %8s %14s %12s %10s %16s\n", pid, "thread", "acquisitions", "contended", "claimed", "wait cycles");
+        for (size_t t = 0; t < per_thread.size(); t++)
+        {
+            const LockStats &st = per_thread[t];
+            printf("[lockstat %ld] %8zu %14llu %12llu %10llu %16llu\n", pid, t,
+                   (unsigned long long)st.acquisitions, (unsigned long long)st.contended,
+                   (unsigned long long)st.claims, (unsigned long long)st.wait_cycles);
+        }
+    }
+};
+
+static LockStatRegistry lockstat_registry;
+
+// the calling thread's stats, handed to the registry when the thread exits
+struct LockStatSlot
+{
+    int id = -1;
+    uint64_t acquired_at = 0;
+    LockStats st;
+
+    ~LockStatSlot()
+    {
+        if (st.acquisitions || st.claims)
+        {
+            lockstat_registry.add(id, st);
+        }
+    }
+};
+
+static thread_local LockStatSlot lockstat_self;
+
+template <class L>
+struct stat_lock
+{
+    L inner;
+};
+
+template <class L>
+static inline void init(stat_lock<L> *m)
+{
+    init(&m->inner);
+}
+
+template <class L>
+static inline void lock(stat_lock<L> *m)
+{
+    LockStatSlot &self = lockstat_self;
+    unsigned long long s0 = lockstat_spins;
+    uint64_t t0 = lockstat_now();
+    lock(&m->inner);
+    uint64_t t1 = lockstat_now();
+
+    uint64_t wait = lockstat_delta(t0, t1);
+    uint64_t spins = lockstat_spins - s0;
+    self.acquired_at = t1;
+    self.st.acquisitions++;
+    self.st.wait_cycles += wait;
+    self.st.spins += spins;
+    if (spins > 0)
+    {
+        self.st.contended++;
+        self.st.contended_cycles += wait;
+    }
+    self.st.wait_hist[lockstat_bucket(wait)]++;
+    self.st.spin_hist[lockstat_bucket(spins)]++;
+}
+
+template <class L>
+static inline void unlock(stat_lock<L> *m)
+{
+    LockStatSlot &self = lockstat_self;
+    uint64_t hold = lockstat_delta(self.acquired_at, lockstat_now());
+    unlock(&m->inner);
+
+    self.st.hold_cycles += hold;
+    self.st.hold_hist[lockstat_bucket(hold)]++;
+}
+
+#define STAT_LOCK(L) stat_lock<L>
+#define LOCKSTAT_THREAD(tid) (lockstat_self.id = (tid))
+#define LOCKSTAT_CLAIM() (lockstat_self.st.claims++)
+
+#endif
+
+#endif
@@ -0,0 +1,145 @@
+// mpi_sched.h
+// dynamic (master / worker) row scheduling for the MPI image programs
+//
+// Rank 0 holds the image and hands out row chunks on demand; every other rank asks
+// for a chunk, works on it and asks again, so a slow node simply takes fewer rows.
+// Chunks are guided: remaining / (2 * workers), never below min_rows, so they start
+// big (few messages) and shrink near the end (short tail).
+//
+//   worker:  RowChunk done = {0, 0}, next;
+//            while (sched_request(round, &done, &next, send_back)) { recv rows, work, done = next; }
+//   master:  sched_serve(round, N, min_rows, send_rows, recv_rows, &log);
+//
+// A worker can hand its last chunk back with the next request (send_back fills in
+// the rows after the request message), or keep its chunks and return them later.
+// `round` counts repeated passes (iterations): a worker that got its stop early may
+// already ask for round r + 1 while the master still serves round r, so requests
+// alternate between two tags and the master never mistakes one for the other.
+
+#ifndef MPI_SCHED_H
+#define MPI_SCHED_H
+
+#include <stdio.h>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <mpi.h>
+
+#define TAG_SCHED_REQ 100  // (+ round & 1) worker -> master: {done start, done count}
+#define TAG_SCHED_GIVE 102 // master -> worker: {start, count}, count 0 = no more rows
+#define TAG_SCHED_ROWS 103 // pixel rows either way
+
+struct RowChunk
+{
+    int start;
+    int count;
+};
+
+static inline int guided_chunk(int remaining, int workers, int min_rows)
+{
+    int c = remaining / (2 * workers);
+    if (c < min_rows)
+    {
+        c = min_rows;
+    }
+    return (c < remaining) ? c : remaining;
+}
+
+// master side. send_rows(worker, chunk) ships a chunk right after its header,
+// recv_rows(worker, chunk) takes back a finished one announced in a request.
+// log[w] gets every chunk given to rank w, in order.
+template <class SendRows, class RecvRows>
+static inline void sched_serve(int round, int total_rows, int min_rows, SendRows send_rows, RecvRows recv_rows,
+                               std::vector<std::vector<RowChunk>> *log)
+{
+    int nprocs;
+    MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+    int workers = nprocs - 1;
+    log->assign(nprocs, std::vector<RowChunk>());
+
+    int next_row = 0, stopped = 0;
+    while (stopped < workers)
+    {
+        int done[2];
+        MPI_Status st;
+        MPI_Recv(done, 2, MPI_INT, MPI_ANY_SOURCE, TAG_SCHED_REQ + (round & 1), MPI_COMM_WORLD, &st);
+        int w = st.MPI_SOURCE;
+        if (done[1] > 0)
+        {
+            RowChunk back = {done[0], done[1]};
+            recv_rows(w, back);
+        }
+
+        RowChunk give = {next_row, 0};
+        if (next_row < total_rows)
+        {
+            give.count = guided_chunk(total_rows - next_row, workers, min_rows);
+            next_row += give.count;
+            (*log)[w].push_back(give);
+        }
+        else
+        {
+            stopped++;
+        }
+        MPI_Send(&give, 2, MPI_INT, w, TAG_SCHED_GIVE, MPI_COMM_WORLD);
+        if (give.count > 0)
+        {
+            send_rows(w, give);
+        }
+    }
+}
+
+// worker side: report `done` (count 0 = nothing to hand back), get the next chunk.
+// send_back(done) must send the finished rows when done->count > 0.
+// Returns 0 once the master is out of rows.
+template <class SendBack>
+static inline int sched_request(int round, const RowChunk *done, RowChunk *next, SendBack send_back)
+{
+    int msg[2] = {done->start, done->count};
+    MPI_Send(msg, 2, MPI_INT, 0, TAG_SCHED_REQ + (round & 1), MPI_COMM_WORLD);
+    if (done->count > 0)
+    {
+        send_back(*done);
+    }
+    MPI_Recv(next, 2, MPI_INT, 0, TAG_SCHED_GIVE, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    return next->count > 0;
+}
+
+// max / avg busy time over ranks [first, nprocs); 1.0 = perfectly balanced.
+// Collective, the line is printed by rank 0.
+static inline void report_imbalance(const char *label, double busy, int first)
+{
+    int rank, nprocs;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+    std::vector<double> all(nprocs);
+    MPI_Gather(&busy, 1, MPI_DOUBLE, all.data(), 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    if (rank != 0)
+    {
+        return;
+    }
+
+    double mx = 0.0, sum = 0.0;
+    for (int p = first; p < nprocs; p++)
+    {
+        mx = (all[p] > mx) ? all[p] : mx;
+        sum += all[p];
+    }
+    double avg = sum / (nprocs - first);
+    printf("%s: busy max %.4f s, avg %.4f s, imbalance (max/avg) %.3f\n", label, mx, avg, (avg > 0.0) ? mx / avg : 1.0);
+}
+
+// --slow <rank>: stand-in for a slow node, that rank sleeps 3x the time it just
+// spent since work_start, so its work takes 4x as long
+static inline void slow_down(int slow_rank, double work_start)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    if (rank == slow_rank)
+    {
+        double t = 3.0 * (MPI_Wtime() - work_start);
+        std::this_thread::sleep_for(std::chrono::duration<double>(t));
+    }
+}
+
+#endif
@@ -0,0 +1,129 @@
+// mpi_slab.h
+// row-slab helpers shared by the MPI image programs (Lab5, lab6, Asgn2)
+//
+// Rows are split the class way: base = N / P, the first N % P ranks get one extra.
+// The MPI-IO helpers move a rank's rows straight between the BMP file and its local
+// buffer, so no rank funnels the whole image through Scatterv / Gatherv.
+
+#ifndef MPI_SLAB_H
+#define MPI_SLAB_H
+
+#include <stdio.h>
+#include <mpi.h>
+
+// first row and row count of `rank`'s slab
+static inline void slab_rows(int N, int nprocs, int rank, int *start, int *nloc)
+{
+    int base = N / nprocs, rem = N % nprocs;
+    *nloc = base + (rank < rem);
+    *start = rank * base + (rank < rem ? rank : rem);
+}
+
+static inline void mpiio_check(int rc, const char *what, const char *filename)
+{
+    if (rc != MPI_SUCCESS)
+    {
+        char msg[MPI_MAX_ERROR_STRING];
+        int len = 0;
+        MPI_Error_string(rc, msg, &len);
+        printf("MPI-IO %s failed on %s: %s\n", what, filename, msg);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+// collective: every rank reads rows [start, start + nloc) of the pixel array
+static inline void mpiio_read_rows(const char *filename, long data_offset, int padding, int start, int nloc, unsigned char *dst)
+{
+    MPI_File fh;
+    mpiio_check(MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh), "open", filename);
+
+    MPI_Offset off = (MPI_Offset)data_offset + (MPI_Offset)start * padding;
+    mpiio_check(MPI_File_read_at_all(fh, off, dst, nloc * padding, MPI_UNSIGNED_CHAR, MPI_STATUS_IGNORE), "read", filename);
+    MPI_File_close(&fh);
+}
+
+// collective: rank 0 writes the header, then every rank writes its rows behind it
+static inline void mpiio_write_rows(const char *filename, const void *header, int header_bytes, int total_rows,
+                                    int padding, int start, int nloc, const unsigned char *src)
+{
+    MPI_File fh;
+    mpiio_check(MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh), "open", filename);
+
+    // drop anything an older, larger file left behind
+    mpiio_check(MPI_File_set_size(fh, (MPI_Offset)header_bytes + (MPI_Offset)total_rows * padding), "set_size", filename);
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    if (rank == 0)
+    {
+        mpiio_check(MPI_File_write_at(fh, 0, header, header_bytes, MPI_UNSIGNED_CHAR, MPI_STATUS_IGNORE), "write header", filename);
+    }
+
+    MPI_Offset off = (MPI_Offset)header_bytes + (MPI_Offset)start * padding;
+    mpiio_check(MPI_File_write_at_all(fh, off, src, nloc * padding, MPI_UNSIGNED_CHAR, MPI_STATUS_IGNORE), "write", filename);
+    MPI_File_close(&fh);
+}
+
+// node-local shared image
+// when every rank lives on one host the image is allocated once with
+// MPI_Win_allocate_shared and ranks load / store their rows in place, so no pixel
+// goes through Scatterv / Gatherv. Phases are separated with MPI_Win_fence.
+struct ShmImage
+{
+    MPI_Comm node_comm;
+    MPI_Win win;
+    unsigned char *base; // whole image, same mapping on every rank of the node
+};
+
+// true when all of MPI_COMM_WORLD shares one node; otherwise callers fall back
+// to scatter / gather
+static inline int shm_single_node()
+{
+    MPI_Comm node_comm;
+    int node_size, world_size;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_size(node_comm, &node_size);
+    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+    MPI_Comm_free(&node_comm);
+
+    int all_local = (node_size == world_size);
+    int all_agree = 0;
+    MPI_Allreduce(&all_local, &all_agree, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+    return all_agree;
+}
+
+// node rank 0 owns all `bytes`, everyone maps them through MPI_Win_shared_query
+static inline void shm_alloc(MPI_Aint bytes, ShmImage *shm)
+{
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &shm->node_comm);
+    int node_rank;
+    MPI_Comm_rank(shm->node_comm, &node_rank);
+
+    unsigned char *mine = NULL;
+    MPI_Win_allocate_shared((node_rank == 0) ? bytes : 0, 1, MPI_INFO_NULL, shm->node_comm, &mine, &shm->win);
+
+    MPI_Aint size;
+    int disp;
+    MPI_Win_shared_query(shm->win, 0, &size, &disp, &shm->base);
+    MPI_Win_fence(0, shm->win);
+}
+
+static inline void shm_free(ShmImage *shm)
+{
+    MPI_Win_free(&shm->win);
+    MPI_Comm_free(&shm->node_comm);
+}
+
+// plain read of `bytes` pixel bytes at `data_offset` (used by the rank filling a window)
+static inline void read_pixels(const char *filename, long data_offset, unsigned char *dst, size_t bytes)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file || fseek(file, data_offset, SEEK_SET) != 0 || fread(dst, 1, bytes, file) != bytes)
+    {
+        printf("Can't read pixel data: %s\n", filename);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    fclose(file);
+}
+
+#endif
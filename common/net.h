@@ -0,0 +1,260 @@
+// net.h
+// socket portability + readiness polling for the spawn / calc programs (Asgn1)
+//
+// Windows keeps Winsock; everywhere else SOCKET is a plain fd and the WSA calls are
+// no-ops, so the same source builds on both.
+//
+//   NetPoll p;
+//   netpoll_open(&p);
+//   netpoll_add(&p, s, key, NET_IN | NET_OUT);   // key comes back with the event
+//   int n = netpoll_wait(&p, ev, 64, -1);         // ev[i].key, ev[i].events
+//   netpoll_mod(&p, s, key, NET_IN);              // done sending
+//
+// Linux uses epoll, so a wait costs the ready sockets only. Other platforms scan a
+// pollfd array with poll() / WSAPoll(); fine for the few dozen workers we run.
+
+#ifndef NET_H
+#define NET_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+struct WSADATA
+{
+    int unused;
+};
+#define MAKEWORD(a, b) ((unsigned short)(((a) & 0xff) | (((b) & 0xff) << 8)))
+static inline int WSAStartup(unsigned short, WSADATA *)
+{
+    return 0;
+}
+static inline void WSACleanup()
+{
+}
+static inline int closesocket(SOCKET s)
+{
+    return close(s);
+}
+#endif
+
+#define NET_IN 1
+#define NET_OUT 2
+#define NET_ERR 4 // hang-up or error, reported whatever was asked for
+
+static inline int net_set_nonblocking(SOCKET s, int on)
+{
+#ifdef _WIN32
+    u_long mode = on ? 1 : 0;
+    return ioctlsocket(s, FIONBIO, &mode) == 0;
+#else
+    int fl = fcntl(s, F_GETFL, 0);
+    return fcntl(s, F_SETFL, on ? (fl | O_NONBLOCK) : (fl & ~O_NONBLOCK)) == 0;
+#endif
+}
+
+// frames go out as a small header followed by the rows: without TCP_NODELAY the
+// rows wait for the header's (delayed) ACK, about 40 ms per job on Linux
+static inline int net_set_nodelay(SOCKET s)
+{
+    int on = 1;
+    return setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on)) == 0;
+}
+
+// the last send / recv on a non-blocking socket only ran out of buffer
+static inline int net_would_block()
+{
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+struct NetEvent
+{
+    int key;
+    int events; // NET_IN | NET_OUT | NET_ERR
+};
+
+#ifdef __linux__
+
+struct NetPoll
+{
+    int ep;
+};
+
+static inline int netpoll_open(NetPoll *p)
+{
+    p->ep = epoll_create1(EPOLL_CLOEXEC);
+    return p->ep >= 0;
+}
+
+static inline void netpoll_close(NetPoll *p)
+{
+    close(p->ep);
+}
+
+static inline int netpoll_ctl(NetPoll *p, int op, SOCKET s, int key, int events)
+{
+    struct epoll_event e;
+    e.events = ((events & NET_IN) ? (uint32_t)EPOLLIN : 0) | ((events & NET_OUT) ? (uint32_t)EPOLLOUT : 0);
+    e.data.u64 = (uint64_t)(uint32_t)key;
+    return epoll_ctl(p->ep, op, s, &e) == 0;
+}
+
+static inline int netpoll_add(NetPoll *p, SOCKET s, int key, int events)
+{
+    return netpoll_ctl(p, EPOLL_CTL_ADD, s, key, events);
+}
+
+static inline int netpoll_mod(NetPoll *p, SOCKET s, int key, int events)
+{
+    return netpoll_ctl(p, EPOLL_CTL_MOD, s, key, events);
+}
+
+static inline int netpoll_del(NetPoll *p, SOCKET s)
+{
+    struct epoll_event e = {};
+    return epoll_ctl(p->ep, EPOLL_CTL_DEL, s, &e) == 0;
+}
+
+// up to `max` ready sockets, -1 = wait forever; returns the count, -1 on error
+static inline int netpoll_wait(NetPoll *p, NetEvent *out, int max, int timeout_ms)
+{
+    struct epoll_event ev[64];
+    int n = epoll_wait(p->ep, ev, (max < 64) ? max : 64, timeout_ms);
+    if (n < 0)
+    {
+        return (errno == EINTR) ? 0 : -1;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        out[i].key = (int)(uint32_t)ev[i].data.u64;
+        out[i].events = ((ev[i].events & EPOLLIN) ? NET_IN : 0) | ((ev[i].events & EPOLLOUT) ? NET_OUT : 0) |
+                        ((ev[i].events & (EPOLLERR | EPOLLHUP)) ? NET_ERR : 0);
+    }
+    return n;
+}
+
+#else
+
+#ifdef _WIN32
+typedef WSAPOLLFD net_pollfd;
+#define net_poll WSAPoll
+#else
+typedef struct pollfd net_pollfd;
+#define net_poll poll
+#endif
+
+struct NetPoll
+{
+    std::vector<net_pollfd> fds;
+    std::vector<int> keys;
+};
+
+static inline int netpoll_open(NetPoll *p)
+{
+    p->fds.clear();
+    p->keys.clear();
+    return 1;
+}
+
+static inline void netpoll_close(NetPoll *p)
+{
+    p->fds.clear();
+    p->keys.clear();
+}
+
+static inline short netpoll_bits(int events)
+{
+    return (short)(((events & NET_IN) ? POLLIN : 0) | ((events & NET_OUT) ? POLLOUT : 0));
+}
+
+static inline int netpoll_add(NetPoll *p, SOCKET s, int key, int events)
+{
+    net_pollfd f;
+    f.fd = s;
+    f.events = netpoll_bits(events);
+    f.revents = 0;
+    p->fds.push_back(f);
+    p->keys.push_back(key);
+    return 1;
+}
+
+static inline int netpoll_mod(NetPoll *p, SOCKET s, int key, int events)
+{
+    for (size_t i = 0; i < p->fds.size(); i++)
+    {
+        if (p->fds[i].fd == s)
+        {
+            p->fds[i].events = netpoll_bits(events);
+            p->keys[i] = key;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline int netpoll_del(NetPoll *p, SOCKET s)
+{
+    for (size_t i = 0; i < p->fds.size(); i++)
+    {
+        if (p->fds[i].fd == s)
+        {
+            p->fds.erase(p->fds.begin() + i);
+            p->keys.erase(p->keys.begin() + i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline int netpoll_wait(NetPoll *p, NetEvent *out, int max, int timeout_ms)
+{
+    int n = net_poll(p->fds.data(), (unsigned long)p->fds.size(), timeout_ms);
+    if (n < 0)
+    {
+        return -1;
+    }
+    int k = 0;
+    for (size_t i = 0; i < p->fds.size() && k < max; i++)
+    {
+        short r = p->fds[i].revents;
+        if (r == 0)
+        {
+            continue;
+        }
+        out[k].key = p->keys[i];
+        out[k].events = ((r & POLLIN) ? NET_IN : 0) | ((r & POLLOUT) ? NET_OUT : 0) |
+                        ((r & (POLLERR | POLLHUP | POLLNVAL)) ? NET_ERR : 0);
+        k++;
+    }
+    return k;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,485 @@
+// placement.h
+// topology-aware thread pinning + NUMA-local first touch for the threaded labs
+//
+// Linux reads the CPU / NUMA layout from sysfs and pins with pthread affinity.
+// On other platforms the topology is a single node and pinning is a no-op.
+//
+// Memory placement relies on the kernel's first-touch policy: a page lands on the
+// node of the thread that first writes it. So buffers are allocated untouched
+// (no_init_allocator / malloc) and each pinned thread writes its own partition first.
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#define PAGE_BYTES 4096
+
+enum PlacementPolicy
+{
+    PLACE_NONE = 0,    // leave it to the OS scheduler
+    PLACE_COMPACT = 1, // fill one node (and SMT siblings) before the next
+    PLACE_SCATTER = 2  // round-robin over nodes, one thread per core before siblings
+};
+
+struct CpuInfo
+{
+    int cpu;
+    int core;    // core_id within the package
+    int package; // physical_package_id (socket)
+    int node;    // NUMA node
+};
+
+struct Topology
+{
+    std::vector<CpuInfo> cpus;
+    int nnodes = 1;
+};
+
+// vector allocator that skips value-initialization, so resize() leaves fresh pages
+// untouched until the owning thread writes them
+template <class T>
+struct no_init_allocator : std::allocator<T>
+{
+    template <class U>
+    struct rebind
+    {
+        typedef no_init_allocator<U> other;
+    };
+    no_init_allocator() = default;
+    template <class U>
+    no_init_allocator(const no_init_allocator<U> &) {}
+
+    template <class U>
+    void construct(U *p)
+    {
+        ::new ((void *)p) U;
+    }
+    template <class U, class... Args>
+    void construct(U *p, Args &&...args)
+    {
+        ::new ((void *)p) U(std::forward<Args>(args)...);
+    }
+};
+
+static inline PlacementPolicy parse_placement(const char *arg)
+{
+    if (strcmp(arg, "compact") == 0)
+    {
+        return PLACE_COMPACT;
+    }
+    else if (strcmp(arg, "scatter") == 0)
+    {
+        return PLACE_SCATTER;
+    }
+    return PLACE_NONE;
+}
+
+static inline const char *placement_name(PlacementPolicy policy)
+{
+    switch (policy)
+    {
+    case PLACE_COMPACT:
+        return "compact";
+    case PLACE_SCATTER:
+        return "scatter";
+    default:
+        return "none";
+    }
+}
+
+// "0-3,8,10-11" -> {0,1,2,3,8,10,11}
+static inline std::vector<int> parse_cpulist(const char *list)
+{
+    std::vector<int> out;
+    const char *p = list;
+    while (*p)
+    {
+        char *end;
+        long a = strtol(p, &end, 10);
+        if (end == p)
+        {
+            break;
+        }
+        long b = a;
+        p = end;
+        if (*p == '-')
+        {
+            b = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long c = a; c <= b; c++)
+        {
+            out.push_back((int)c);
+        }
+        if (*p == ',')
+        {
+            p++;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return out;
+}
+
+static inline bool read_sysfs_line(const char *path, char *buf, int len)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        return false;
+    }
+    bool ok = fgets(buf, len, file) != NULL;
+    fclose(file);
+    return ok;
+}
+
+static inline int read_sysfs_int(const char *path, int fallback)
+{
+    char buf[64];
+    if (!read_sysfs_line(path, buf, sizeof(buf)))
+    {
+        return fallback;
+    }
+    return atoi(buf);
+}
+
+static inline Topology read_topology()
+{
+    Topology topo;
+    char buf[4096];
+    char path[256];
+
+    std::vector<int> online;
+    if (read_sysfs_line("/sys/devices/system/cpu/online", buf, sizeof(buf)))
+    {
+        online = parse_cpulist(buf);
+    }
+    if (online.empty())
+    {
+        int n = (int)std::thread::hardware_concurrency();
+        for (int i = 0; i < std::max(n, 1); i++)
+        {
+            online.push_back(i);
+        }
+    }
+
+    for (int cpu : online)
+    {
+        CpuInfo ci;
+        ci.cpu = cpu;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        ci.core = read_sysfs_int(path, cpu);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        ci.package = read_sysfs_int(path, 0);
+        ci.node = 0;
+        topo.cpus.push_back(ci);
+    }
+
+    // node membership comes from each node's cpulist
+    std::vector<int> nodes;
+    if (read_sysfs_line("/sys/devices/system/node/online", buf, sizeof(buf)))
+    {
+        nodes = parse_cpulist(buf);
+    }
+    topo.nnodes = 1;
+    for (int node : nodes)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (!read_sysfs_line(path, buf, sizeof(buf)))
+        {
+            continue;
+        }
+        for (int cpu : parse_cpulist(buf))
+        {
+            for (CpuInfo &ci : topo.cpus)
+            {
+                if (ci.cpu == cpu)
+                {
+                    ci.node = node;
+                }
+            }
+        }
+        topo.nnodes = std::max(topo.nnodes, node + 1);
+    }
+    return topo;
+}
+
+// cpu for each of `count` threads starting at slot `first` (so several processes on one
+// host can take disjoint slices); -1 means do not pin
+static inline std::vector<int> placement_cpus(const Topology &topo, PlacementPolicy policy, int count, int first = 0)
+{
+    std::vector<int> out(count, -1);
+    if (policy == PLACE_NONE || topo.cpus.empty())
+    {
+        return out;
+    }
+
+    std::vector<CpuInfo> order = topo.cpus;
+    if (policy == PLACE_COMPACT)
+    {
+        // node, socket, core, then SMT siblings next to each other
+        std::sort(order.begin(), order.end(), [](const CpuInfo &a, const CpuInfo &b)
+                  {
+                      if (a.node != b.node) return a.node < b.node;
+                      if (a.package != b.package) return a.package < b.package;
+                      if (a.core != b.core) return a.core < b.core;
+                      return a.cpu < b.cpu; });
+    }
+    else
+    {
+        // within each node: first sibling of every core, then the second siblings, ...
+        // then deal nodes out round-robin
+        std::vector<std::vector<CpuInfo>> per_node(topo.nnodes);
+        for (const CpuInfo &ci : topo.cpus)
+        {
+            per_node[ci.node].push_back(ci);
+        }
+        for (std::vector<CpuInfo> &list : per_node)
+        {
+            std::sort(list.begin(), list.end(), [](const CpuInfo &a, const CpuInfo &b)
+                      {
+                          if (a.package != b.package) return a.package < b.package;
+                          if (a.core != b.core) return a.core < b.core;
+                          return a.cpu < b.cpu; });
+            std::vector<CpuInfo> ranked;
+            std::vector<bool> used(list.size(), false);
+            while (ranked.size() < list.size())
+            {
+                int last_core = -1, last_pkg = -1;
+                for (size_t i = 0; i < list.size(); i++)
+                {
+                    if (!used[i] && (list[i].core != last_core || list[i].package != last_pkg))
+                    {
+                        ranked.push_back(list[i]);
+                        used[i] = true;
+                        last_core = list[i].core;
+                        last_pkg = list[i].package;
+                    }
+                }
+            }
+            list = ranked;
+        }
+        order.clear();
+        for (size_t i = 0; order.size() < topo.cpus.size(); i++)
+        {
+            for (std::vector<CpuInfo> &list : per_node)
+            {
+                if (i < list.size())
+                {
+                    order.push_back(list[i]);
+                }
+            }
+        }
+    }
+
+    for (int t = 0; t < count; t++)
+    {
+        out[t] = order[(size_t)(first + t) % order.size()].cpu;
+    }
+    return out;
+}
+
+// pin the calling thread; returns false if not supported / failed
+static inline bool pin_thread(int cpu)
+{
+#ifdef __linux__
+    if (cpu < 0)
+    {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+static inline int node_of_cpu(const Topology &topo, int cpu)
+{
+    for (const CpuInfo &ci : topo.cpus)
+    {
+        if (ci.cpu == cpu)
+        {
+            return ci.node;
+        }
+    }
+    return 0;
+}
+
+static inline void print_placement(const Topology &topo, PlacementPolicy policy, const std::vector<int> &cpus)
+{
+    printf("Placement: %s (%zu cpus, %d nodes)\n", placement_name(policy), topo.cpus.size(), topo.nnodes);
+    if (policy == PLACE_NONE)
+    {
+        return;
+    }
+    for (size_t t = 0; t < cpus.size(); t++)
+    {
+        printf("  thread %zu -> cpu %d (node %d)\n", t, cpus[t], node_of_cpu(topo, cpus[t]));
+    }
+}
+
+// static block partition of `n` items: [*begin, *end) for thread t
+static inline void partition_range(size_t n, int nthreads, int t, size_t *begin, size_t *end)
+{
+    size_t base = n / nthreads;
+    size_t rem = n % nthreads;
+    *begin = t * base + std::min((size_t)t, rem);
+    *end = *begin + base + ((size_t)t < rem ? 1 : 0);
+}
+
+// write one byte per page so the pages are allocated on the calling thread's node
+static inline void first_touch(uint8_t *p, size_t bytes)
+{
+    for (size_t off = 0; off < bytes; off += PAGE_BYTES)
+    {
+        p[off] = 0;
+    }
+    if (bytes > 0)
+    {
+        p[bytes - 1] = 0;
+    }
+}
+
+// read [file_offset, file_offset + bytes) of a file into dst from the calling thread,
+// so the destination pages are first touched there
+static inline bool read_file_range(const char *filename, long file_offset, uint8_t *dst, size_t bytes)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+    {
+        return false;
+    }
+    bool ok = fseek(file, file_offset, SEEK_SET) == 0 && fread(dst, 1, bytes, file) == bytes;
+    fclose(file);
+    return ok;
+}
+
+// first-touch `buf` in per-thread partitions from threads pinned like the workers will be
+static inline void parallel_first_touch(uint8_t *buf, size_t bytes, const std::vector<int> &cpus)
+{
+    int nthreads = (int)cpus.size();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++)
+    {
+        threads.emplace_back([=]()
+                             {
+                                 pin_thread(cpus[t]);
+                                 size_t b, e;
+                                 partition_range(bytes, nthreads, t, &b, &e);
+                                 first_touch(buf + b, e - b); });
+    }
+    for (std::thread &th : threads)
+    {
+        th.join();
+    }
+}
+
+// local vs remote read bandwidth: a buffer is first touched from a cpu on node `mem`,
+// then streamed from a cpu on node `run`. Diagonal entries are local; 0 if the
+// buffer can't be allocated.
+static inline double read_bandwidth(int run_cpu, int mem_cpu, size_t bytes, int reps)
+{
+    uint64_t *buf = (uint64_t *)malloc(bytes);
+    if (!buf)
+    {
+        return 0.0;
+    }
+    size_t words = bytes / sizeof(uint64_t);
+    double gbps = 0.0;
+    volatile uint64_t sink = 0; // keeps the read loop from being optimized out
+
+    std::thread toucher([=]()
+                        {
+                            pin_thread(mem_cpu);
+                            for (size_t i = 0; i < words; i++)
+                                buf[i] = i; });
+    toucher.join();
+
+    std::thread reader([&]()
+                       {
+                           pin_thread(run_cpu);
+                           uint64_t s = 0;
+                           auto t0 = std::chrono::steady_clock::now();
+                           for (int r = 0; r < reps; r++)
+                           {
+                               for (size_t i = 0; i < words; i++)
+                                   s += buf[i];
+                           }
+                           auto t1 = std::chrono::steady_clock::now();
+                           double sec = std::chrono::duration<double>(t1 - t0).count();
+                           gbps = (double)bytes * reps / sec / 1e9;
+                           sink = s; });
+    reader.join();
+
+    free(buf);
+    return gbps;
+}
+
+static inline void placement_bandwidth_report(const Topology &topo)
+{
+    printf("Topology: %zu cpus, %d nodes\n", topo.cpus.size(), topo.nnodes);
+    for (const CpuInfo &ci : topo.cpus)
+    {
+        printf("  cpu %3d: node %d package %d core %d\n", ci.cpu, ci.node, ci.package, ci.core);
+    }
+
+    // first cpu of every node
+    std::vector<int> node_cpu(topo.nnodes, -1);
+    for (const CpuInfo &ci : topo.cpus)
+    {
+        if (node_cpu[ci.node] < 0)
+        {
+            node_cpu[ci.node] = ci.cpu;
+        }
+    }
+
+    const size_t bytes = (size_t)256 << 20;
+    printf("Read bandwidth GB/s (row: running node, col: memory node)\n");
+    printf("%8s", "");
+    for (int m = 0; m < topo.nnodes; m++)
+    {
+        printf("  mem%-5d", m);
+    }
+    printf("\n");
+    for (int r = 0; r < topo.nnodes; r++)
+    {
+        if (node_cpu[r] < 0)
+        {
+            continue;
+        }
+        printf("  node%-2d", r);
+        for (int m = 0; m < topo.nnodes; m++)
+        {
+            if (node_cpu[m] < 0)
+            {
+                printf("  %8s", "-");
+                continue;
+            }
+            printf("  %8.2f", read_bandwidth(node_cpu[r], node_cpu[m], bytes, 4));
+        }
+        printf("\n");
+    }
+}
+
+#endif
@@ -0,0 +1,352 @@
+// pointop.h
+// per-channel 8-bit point operators compiled into lookup tables
+//
+//   PointOp op;
+//   pointop_identity(&op);
+//   pointop_map(&op, POINTOP_ALL, [&](int x) { return contrast(x); });  // every channel
+//   pointop_map(&op, 0, [&](int x) { return (int)(x * 0.9); });        // then B only
+//   pointop_apply(&op, data, rows, width, padding);
+//
+// pointop_map composes: the new function is applied to what the table already
+// produces, so a chain of maps costs one lookup per byte. Results are clamped to
+// [0, 255]. Channel order is the BMP one, 0 = B, 1 = G, 2 = R.
+//
+// Apply paths, picked at compile time:
+//   __AVX512VBMI__  vpermi2b lookups, 64 bytes per step (-mavx512vbmi)
+//   __AVX2__        per-channel tables: vpgatherdd from a 768-entry int table,
+//                   24 bytes per step (-mavx2, /arch:AVX2)
+//   otherwise       scalar, three table loads per pixel
+//
+// A table that is one straight line, clamp(floor(gain * x + offset)) on all three
+// channels (contrast), can also be evaluated as integer arithmetic:
+//
+//   pointop_linear(&op, gain, offset);   // after building the table, 1 if it fits
+//
+// looks for a fixed-point mul / add / shift that reproduces the table exactly, and
+// below AVX512VBMI the SSE2 path then does 16 bytes per step with no lookups.
+
+#ifndef POINTOP_H
+#define POINTOP_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__AVX512VBMI__)
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define POINTOP_SSE2 1
+#endif
+
+#define POINTOP_ALL -1
+
+struct PointOp
+{
+    uint8_t lut[3][256]; // [channel][input]
+    int uniform;         // all three channels hold the same table
+    int wide[3 * 256];   // lut as ints at channel * 256 + input (gather path)
+    int linear;          // lut[*][x] == clamp((x * mul + add) >> shift), see pointop_linear
+    int mul, add, shift;
+};
+
+static inline void pointop_update(PointOp *op)
+{
+    op->uniform = memcmp(op->lut[0], op->lut[1], 256) == 0 && memcmp(op->lut[0], op->lut[2], 256) == 0;
+    op->linear = 0;
+    for (int ch = 0; ch < 3; ch++)
+    {
+        for (int x = 0; x < 256; x++)
+        {
+            op->wide[ch * 256 + x] = op->lut[ch][x];
+        }
+    }
+}
+
+static inline void pointop_identity(PointOp *op)
+{
+    for (int ch = 0; ch < 3; ch++)
+    {
+        for (int x = 0; x < 256; x++)
+        {
+            op->lut[ch][x] = (uint8_t)x;
+        }
+    }
+    pointop_update(op);
+}
+
+static inline uint8_t pointop_clamp(int y)
+{
+    return (uint8_t)(y < 0 ? 0 : (y > 255 ? 255 : y));
+}
+
+// lut[ch] = f o lut[ch] for one channel, or all of them with POINTOP_ALL
+template <class F>
+static inline void pointop_map(PointOp *op, int channel, F f)
+{
+    for (int ch = 0; ch < 3; ch++)
+    {
+        if (channel != POINTOP_ALL && channel != ch)
+        {
+            continue;
+        }
+        // f sees each distinct input once
+        uint8_t out[256];
+        for (int x = 0; x < 256; x++)
+        {
+            out[x] = pointop_clamp(f(x));
+        }
+        for (int x = 0; x < 256; x++)
+        {
+            op->lut[ch][x] = out[op->lut[ch][x]];
+        }
+    }
+    pointop_update(op);
+}
+
+// the table is clamp(floor(gain * x + offset)) on every channel: find integers for
+// the fixed-point form, with as many fraction bits as 32-bit sums allow, checked
+// against the whole table since gain and offset are doubles; 0 leaves the lookups
+// in charge
+static inline int pointop_linear(PointOp *op, double gain, double offset)
+{
+    op->linear = 0;
+    double g = (gain < 0.0) ? -gain : gain;
+    double o = (offset < 0.0) ? -offset : offset;
+    double range = 255.0 * g + o + 2.0; // |x * gain + offset| and nudges, in units
+    if (!op->uniform || range >= 1e9)
+    {
+        return 0;
+    }
+    int shift = 0;
+    while (shift < 30 && range * (double)(1 << (shift + 1)) < 2147483647.0)
+    {
+        shift++;
+    }
+    double scale = (double)(1 << shift);
+    int mul0 = (int)(gain * scale + ((gain < 0.0) ? -0.5 : 0.5));
+    double add_d = offset * scale;
+    int add0 = (int)(add_d + ((add_d < 0.0) ? -0.5 : 0.5));
+    for (int dm = -1; dm <= 1; dm++)
+    {
+        for (int da = -2; da <= 2; da++)
+        {
+            int mul = mul0 + dm, add = add0 + da, x = 0;
+            while (x < 256 && pointop_clamp((x * mul + add) >> shift) == op->lut[0][x])
+            {
+                x++;
+            }
+            if (x == 256)
+            {
+                op->mul = mul;
+                op->add = add;
+                op->shift = shift;
+                op->linear = 1;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// scalar reference: n bytes, starting on a B byte
+static inline void pointop_row_scalar(const PointOp *op, uint8_t *p, int n)
+{
+    if (op->uniform)
+    {
+        const uint8_t *t = op->lut[0];
+        for (int j = 0; j < n; j++)
+        {
+            p[j] = t[p[j]];
+        }
+        return;
+    }
+    const uint8_t *tb = op->lut[0], *tg = op->lut[1], *tr = op->lut[2];
+    int j = 0;
+    for (; j + 3 <= n; j += 3)
+    {
+        p[j + 0] = tb[p[j + 0]];
+        p[j + 1] = tg[p[j + 1]];
+        p[j + 2] = tr[p[j + 2]];
+    }
+    if (j < n)
+    {
+        p[j] = tb[p[j]];
+    }
+    if (j + 1 < n)
+    {
+        p[j + 1] = tg[p[j + 1]];
+    }
+}
+
+#if defined(__AVX512VBMI__)
+
+// 256-entry lookup = two 128-entry vpermi2b, picked by bit 7 of the input
+static inline __m512i pointop_lookup512(const __m512i *t, __m512i x)
+{
+    __m512i lo = _mm512_permutex2var_epi8(t[0], x, t[1]);
+    __m512i hi = _mm512_permutex2var_epi8(t[2], x, t[3]);
+    return _mm512_mask_blend_epi8(_mm512_movepi8_mask(x), lo, hi);
+}
+
+static inline int pointop_row_simd(const PointOp *op, uint8_t *p, int n)
+{
+    __m512i t[3][4];
+    for (int ch = 0; ch < 3; ch++)
+    {
+        for (int q = 0; q < 4; q++)
+        {
+            t[ch][q] = _mm512_loadu_si512((const void *)(op->lut[ch] + 64 * q));
+        }
+    }
+
+    int j = 0;
+    if (op->uniform)
+    {
+        for (; j + 64 <= n; j += 64)
+        {
+            __m512i x = _mm512_loadu_si512((const void *)(p + j));
+            _mm512_storeu_si512((void *)(p + j), pointop_lookup512(t[0], x));
+        }
+        return j;
+    }
+
+    // 192 bytes = 3 vectors = 64 pixels; byte i of vector k is channel (64k + i) % 3
+    const __mmask64 is_g[3] = {0x2492492492492492ULL, 0x9249249249249249ULL, 0x4924924924924924ULL};
+    const __mmask64 is_r[3] = {0x4924924924924924ULL, 0x2492492492492492ULL, 0x9249249249249249ULL};
+    for (; j + 192 <= n; j += 192)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            __m512i x = _mm512_loadu_si512((const void *)(p + j + 64 * k));
+            __m512i y = pointop_lookup512(t[0], x);
+            y = _mm512_mask_blend_epi8(is_g[k], y, pointop_lookup512(t[1], x));
+            y = _mm512_mask_blend_epi8(is_r[k], y, pointop_lookup512(t[2], x));
+            _mm512_storeu_si512((void *)(p + j + 64 * k), y);
+        }
+    }
+    return j;
+}
+
+#elif defined(__AVX2__)
+
+static inline int pointop_row_simd(const PointOp *op, uint8_t *p, int n)
+{
+    // a shared table stays scalar: the one-table loop measured faster than both the
+    // gather and a 16-pass pshufb nibble lookup
+    if (op->uniform)
+    {
+        return 0;
+    }
+
+    // gather from op->wide, 24 bytes (8 pixels) per step, byte i of 8-byte group k
+    // is channel (8k + i) % 3
+    int j = 0;
+    __m256i off[3];
+    for (int k = 0; k < 3; k++)
+    {
+        int o[8];
+        for (int i = 0; i < 8; i++)
+        {
+            o[i] = ((8 * k + i) % 3) * 256;
+        }
+        off[k] = _mm256_loadu_si256((const __m256i *)o);
+    }
+    // low byte of each int -> bytes 0..3 of each 128-bit lane, then lanes together
+    const __m256i pack = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                          0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i join = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+    for (; j + 24 <= n; j += 24)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            __m128i x8 = _mm_loadl_epi64((const __m128i *)(p + j + 8 * k));
+            __m256i idx = _mm256_add_epi32(_mm256_cvtepu8_epi32(x8), off[k]);
+            __m256i y = _mm256_i32gather_epi32(op->wide, idx, 4);
+            y = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(y, pack), join);
+            _mm_storel_epi64((__m128i *)(p + j + 8 * k), _mm256_castsi256_si128(y));
+        }
+    }
+    return j;
+}
+
+#else
+
+static inline int pointop_row_simd(const PointOp *, uint8_t *, int)
+{
+    return 0;
+}
+
+#endif
+
+#if defined(POINTOP_SSE2) && !defined(__AVX512VBMI__)
+
+// 4 bytes widened to ints -> (x * mul + add) >> shift, still ints. pmaddwd takes
+// 16-bit factors, so mul goes in as hi * 2^15 + lo.
+static inline __m128i pointop_linear4(__m128i x, __m128i hi, __m128i lo, __m128i add, __m128i shift)
+{
+    __m128i y = _mm_add_epi32(_mm_slli_epi32(_mm_madd_epi16(x, hi), 15), _mm_madd_epi16(x, lo));
+    return _mm_sra_epi32(_mm_add_epi32(y, add), shift);
+}
+
+// the fixed-point line, 16 bytes per step; the pack steps saturate, which is the
+// clamp. Any channel order: every byte gets the same function.
+static inline int pointop_row_linear(const PointOp *op, uint8_t *p, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mul_hi = _mm_set1_epi32((op->mul >> 15) & 0xffff); // (hi, 0) pairs against (x, 0)
+    const __m128i mul_lo = _mm_set1_epi32(op->mul & 0x7fff);
+    const __m128i add = _mm_set1_epi32(op->add);
+    const __m128i shift = _mm_cvtsi32_si128(op->shift);
+    int j = 0;
+    for (; j + 16 <= n; j += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p + j));
+        __m128i lo = _mm_unpacklo_epi8(x, zero), hi = _mm_unpackhi_epi8(x, zero);
+        __m128i y0 = pointop_linear4(_mm_unpacklo_epi16(lo, zero), mul_hi, mul_lo, add, shift);
+        __m128i y1 = pointop_linear4(_mm_unpackhi_epi16(lo, zero), mul_hi, mul_lo, add, shift);
+        __m128i y2 = pointop_linear4(_mm_unpacklo_epi16(hi, zero), mul_hi, mul_lo, add, shift);
+        __m128i y3 = pointop_linear4(_mm_unpackhi_epi16(hi, zero), mul_hi, mul_lo, add, shift);
+        __m128i y = _mm_packus_epi16(_mm_packs_epi32(y0, y1), _mm_packs_epi32(y2, y3));
+        _mm_storeu_si128((__m128i *)(p + j), y);
+    }
+    return j;
+}
+
+#else
+
+static inline int pointop_row_linear(const PointOp *, uint8_t *, int)
+{
+    return 0;
+}
+
+#endif
+
+// one row of `width` BGR pixels
+static inline void pointop_row(const PointOp *op, uint8_t *row, int width)
+{
+    int n = width * 3;
+    int j = op->linear ? pointop_row_linear(op, row, n) : 0;
+    if (j == 0)
+    {
+        j = pointop_row_simd(op, row, n); // stops on a pixel boundary
+    }
+    pointop_row_scalar(op, row + j, n - j);
+}
+
+// `rows` rows of `width` pixels, `padding` bytes apart
+static inline void pointop_apply(const PointOp *op, uint8_t *data, int rows, int width, int padding)
+{
+    if (padding == width * 3)
+    {
+        // no row padding: one long row
+        pointop_row(op, data, width * rows);
+        return;
+    }
+    for (int i = 0; i < rows; i++)
+    {
+        pointop_row(op, data + (size_t)i * padding, width);
+    }
+}
+
+#endif
@@ -0,0 +1,247 @@
+// resultcache.h
+// LRU of results by 64-bit key (hash64.h): in memory up to a byte budget, and
+// optionally in a directory of files with a budget of its own
+//
+//   ResultCache c;
+//   cache_open(&c, 64 << 20, "cache", 256 << 20);   // dir NULL: memory only
+//   const std::vector<uint8_t> *r = cache_get(&c, key, len);   // NULL on a miss
+//   cache_put(&c, key, data, len, persist);
+//
+// A hit must also have the length the caller expects, which catches most key
+// collisions that would matter. Only `persist` entries go to disk (whole images in
+// spawn); a disk hit is read back into memory. Files are <key in hex>.res and
+// their modification time is the recency, so the LRU order survives a restart:
+// cache_open lists the directory oldest first and evicts from there, and drops any
+// *.res.tmp a crashed run left behind.
+
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+#include <system_error>
+
+struct CacheEntry
+{
+    uint64_t key;
+    std::vector<uint8_t> data;
+};
+
+struct DiskEntry
+{
+    uint64_t key;
+    size_t bytes;
+};
+
+struct ResultCache
+{
+    size_t limit; // memory budget in bytes, 0 = off
+    size_t bytes;
+    std::list<CacheEntry> lru; // most recent first
+    std::unordered_map<uint64_t, std::list<CacheEntry>::iterator> index;
+
+    std::string dir; // empty = no disk tier
+    size_t disk_limit;
+    size_t disk_bytes;
+    std::list<DiskEntry> disk_lru; // most recent first
+    std::unordered_map<uint64_t, std::list<DiskEntry>::iterator> disk_index;
+
+    std::vector<uint8_t> side; // a disk hit bigger than the memory budget
+
+    int hits, disk_hits, misses;
+};
+
+static inline std::string cache_path(const ResultCache *c, uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.res", (unsigned long long)key);
+    return c->dir + "/" + name;
+}
+
+static inline void cache_evict_disk(ResultCache *c)
+{
+    while (c->disk_bytes > c->disk_limit && !c->disk_lru.empty())
+    {
+        DiskEntry &e = c->disk_lru.back();
+        std::error_code ec;
+        std::filesystem::remove(cache_path(c, e.key), ec);
+        c->disk_bytes -= e.bytes;
+        c->disk_index.erase(e.key);
+        c->disk_lru.pop_back();
+    }
+}
+
+// dir may be NULL; 0 if the directory can't be used (the memory tier still works)
+static inline int cache_open(ResultCache *c, size_t limit, const char *dir, size_t disk_limit)
+{
+    c->limit = limit;
+    c->bytes = 0;
+    c->lru.clear();
+    c->index.clear();
+    c->dir = dir ? dir : "";
+    c->disk_limit = disk_limit;
+    c->disk_bytes = 0;
+    c->disk_lru.clear();
+    c->disk_index.clear();
+    c->side.clear();
+    c->hits = c->disk_hits = c->misses = 0;
+    if (c->dir.empty())
+    {
+        return 1;
+    }
+
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::create_directories(c->dir, ec);
+    if (!fs::is_directory(c->dir, ec))
+    {
+        c->dir.clear();
+        return 0;
+    }
+    struct Found
+    {
+        fs::file_time_type when;
+        DiskEntry e;
+    };
+    std::vector<Found> found;
+    std::vector<fs::path> stale;
+    for (const fs::directory_entry &f : fs::directory_iterator(c->dir, ec))
+    {
+        std::string name = f.path().filename().string();
+        if (name.size() > 8 && name.compare(name.size() - 8, 8, ".res.tmp") == 0)
+        {
+            stale.push_back(f.path()); // left by a run that died between write and rename
+            continue;
+        }
+        unsigned long long key;
+        char tail[8];
+        if (name.size() != 20 || sscanf(name.c_str(), "%16llx.%3s", &key, tail) != 2 || std::string(tail) != "res")
+        {
+            continue;
+        }
+        Found x;
+        x.when = f.last_write_time(ec);
+        x.e.key = (uint64_t)key;
+        x.e.bytes = (size_t)f.file_size(ec);
+        found.push_back(x);
+    }
+    for (const fs::path &p : stale)
+    {
+        fs::remove(p, ec);
+    }
+    std::sort(found.begin(), found.end(), [](const Found &a, const Found &b) { return a.when > b.when; });
+    for (const Found &x : found)
+    {
+        c->disk_lru.push_back(x.e);
+        c->disk_index[x.e.key] = std::prev(c->disk_lru.end());
+        c->disk_bytes += x.e.bytes;
+    }
+    cache_evict_disk(c);
+    return 1;
+}
+
+static inline void cache_put_memory(ResultCache *c, uint64_t key, const uint8_t *data, size_t len)
+{
+    if (len > c->limit)
+    {
+        return;
+    }
+    auto it = c->index.find(key);
+    if (it != c->index.end())
+    {
+        c->bytes -= it->second->data.size();
+        c->lru.erase(it->second);
+        c->index.erase(it);
+    }
+    c->lru.push_front(CacheEntry{key, std::vector<uint8_t>(data, data + len)});
+    c->index[key] = c->lru.begin();
+    c->bytes += len;
+    while (c->bytes > c->limit)
+    {
+        CacheEntry &old = c->lru.back();
+        c->bytes -= old.data.size();
+        c->index.erase(old.key);
+        c->lru.pop_back();
+    }
+}
+
+// the cached result for `key` if it has `len` bytes; valid until the next cache_get
+// or cache_put on the same cache
+static inline const std::vector<uint8_t> *cache_get(ResultCache *c, uint64_t key, size_t len)
+{
+    auto it = c->index.find(key);
+    if (it != c->index.end() && it->second->data.size() == len)
+    {
+        c->lru.splice(c->lru.begin(), c->lru, it->second);
+        c->hits++;
+        return &c->lru.front().data;
+    }
+
+    auto dt = c->disk_index.find(key);
+    if (dt != c->disk_index.end() && dt->second->bytes == len)
+    {
+        std::vector<uint8_t> data(len);
+        std::ifstream in(cache_path(c, key), std::ios::binary);
+        if (in.read((char *)data.data(), (std::streamsize)len))
+        {
+            c->disk_lru.splice(c->disk_lru.begin(), c->disk_lru, dt->second);
+            std::error_code ec;
+            std::filesystem::last_write_time(cache_path(c, key), std::filesystem::file_time_type::clock::now(), ec);
+            c->disk_hits++;
+            cache_put_memory(c, key, data.data(), len);
+            auto m = c->index.find(key);
+            if (m != c->index.end())
+            {
+                return &m->second->data;
+            }
+            // bigger than the memory budget: hand it out from the side slot
+            c->side.swap(data);
+            return &c->side;
+        }
+    }
+    c->misses++;
+    return NULL;
+}
+
+static inline void cache_put(ResultCache *c, uint64_t key, const uint8_t *data, size_t len, int persist)
+{
+    cache_put_memory(c, key, data, len);
+    if (!persist || c->dir.empty() || len > c->disk_limit || c->disk_index.count(key))
+    {
+        return;
+    }
+    // write under a temporary name, so a crash never leaves a short file behind
+    std::string path = cache_path(c, key);
+    std::string tmp = path + ".tmp";
+    std::error_code ec;
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write((const char *)data, (std::streamsize)len);
+        out.close();
+        if (!out)
+        {
+            // disk full or a short write: drop the partial file, it is not counted
+            std::filesystem::remove(tmp, ec);
+            return;
+        }
+    }
+    std::filesystem::rename(tmp, path, ec);
+    if (ec)
+    {
+        std::filesystem::remove(tmp, ec);
+        return;
+    }
+    c->disk_lru.push_front(DiskEntry{key, len});
+    c->disk_index[key] = c->disk_lru.begin();
+    c->disk_bytes += len;
+    cache_evict_disk(c);
+}
+
+#endif
@@ -0,0 +1,123 @@
+// shmseg.h
+// named POSIX shared-memory segment holding the image for spawn and its local workers
+//
+//   coordinator:  shmseg_create(&seg, name);  shmseg_reserve(&seg, bytes);  ...  shmseg_destroy(&seg);
+//   worker:       shmseg_open(&seg, name);    shmseg_map(&seg, end);        ...  shmseg_close(&seg);
+//
+// The coordinator grows the segment when a bigger image comes in; a worker remaps
+// when a job reaches past what it has mapped, so only offsets travel on the socket.
+// POSIX only (Windows builds keep moving rows over TCP).
+
+#ifndef SHMSEG_H
+#define SHMSEG_H
+
+#ifndef _WIN32
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct ShmSegment
+{
+    char name[64];
+    int fd;
+    uint8_t *base;
+    size_t bytes; // mapped
+};
+
+static inline void shmseg_unmap(ShmSegment *seg)
+{
+    if (seg->base)
+    {
+        munmap(seg->base, seg->bytes);
+    }
+    seg->base = NULL;
+    seg->bytes = 0;
+}
+
+static inline int shmseg_create(ShmSegment *seg, const char *name)
+{
+    snprintf(seg->name, sizeof(seg->name), "%s", name);
+    seg->base = NULL;
+    seg->bytes = 0;
+    seg->fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    return seg->fd >= 0;
+}
+
+static inline int shmseg_open(ShmSegment *seg, const char *name)
+{
+    snprintf(seg->name, sizeof(seg->name), "%s", name);
+    seg->base = NULL;
+    seg->bytes = 0;
+    seg->fd = shm_open(name, O_RDWR, 0600);
+    return seg->fd >= 0;
+}
+
+// coordinator: at least `bytes` in the segment and mapped
+static inline int shmseg_reserve(ShmSegment *seg, size_t bytes)
+{
+    if (bytes <= seg->bytes)
+    {
+        return 1;
+    }
+    shmseg_unmap(seg);
+    if (ftruncate(seg->fd, (off_t)bytes) != 0)
+    {
+        return 0;
+    }
+    void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (p == MAP_FAILED)
+    {
+        return 0;
+    }
+    seg->base = (uint8_t *)p;
+    seg->bytes = bytes;
+    return 1;
+}
+
+// worker: the first `end` bytes mapped, remapping to the segment's current size
+static inline int shmseg_map(ShmSegment *seg, size_t end)
+{
+    if (end <= seg->bytes)
+    {
+        return 1;
+    }
+    struct stat st;
+    if (fstat(seg->fd, &st) != 0 || (size_t)st.st_size < end)
+    {
+        return 0;
+    }
+    shmseg_unmap(seg);
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (p == MAP_FAILED)
+    {
+        return 0;
+    }
+    seg->base = (uint8_t *)p;
+    seg->bytes = (size_t)st.st_size;
+    return 1;
+}
+
+static inline void shmseg_close(ShmSegment *seg)
+{
+    shmseg_unmap(seg);
+    if (seg->fd >= 0)
+    {
+        close(seg->fd);
+    }
+    seg->fd = -1;
+}
+
+static inline void shmseg_destroy(ShmSegment *seg)
+{
+    shmseg_close(seg);
+    shm_unlink(seg->name);
+}
+
+#endif
+
+#endif
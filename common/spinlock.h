@@ -0,0 +1,272 @@
+// spinlock.h
+// lock library with the class-code interface: init(&m), lock(&m), unlock(&m)
+//
+//   tas_lock_t     bare test-and-set loop (the original lock_t, kept as a baseline);
+//                  every spin is an RFO that bounces the line between waiters
+//   ttas_lock_t    test-and-test-and-set: spins on a plain load, pause + exponential
+//                  backoff, and only tries the exchange once the lock looks free
+//   ticket_lock_t  FIFO ticket lock, spins on the now-serving counter
+//   mcs_lock_t     MCS queue lock, every waiter spins on its own cache line
+//   futex_lock_t   blocking mutex (Linux futex, yield loop elsewhere)
+
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <atomic>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifndef CACHE_LINE
+#define CACHE_LINE 64
+#endif
+
+#define BACKOFF_MIN 4
+#define BACKOFF_MAX 1024
+#define SPIN_YIELD 4096 // spins before giving the cpu away (threads > cores)
+
+// spin iterations of the calling thread, read by lockstat.h (-DLOCK_STATS)
+#ifdef LOCK_STATS
+static thread_local unsigned long long lockstat_spins = 0;
+#define LOCKSTAT_SPIN() (lockstat_spins++)
+#else
+#define LOCKSTAT_SPIN() ((void)0)
+#endif
+
+// tell the core we are spinning (frees pipeline / SMT sibling resources)
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// one wait iteration: pause, and yield every SPIN_YIELD spins so an oversubscribed
+// box still lets the lock holder (or the next in line) run
+static inline void spin_wait(unsigned *spins)
+{
+    LOCKSTAT_SPIN();
+    cpu_relax();
+    if (++(*spins) % SPIN_YIELD == 0)
+    {
+        std::this_thread::yield();
+    }
+}
+
+/* test-and-set: every spin iteration is an RFO on the lock line */
+struct tas_lock_t
+{
+    std::atomic_flag f = ATOMIC_FLAG_INIT;
+};
+static inline void init(tas_lock_t *m)
+{
+    m->f.clear();
+}
+static inline void lock(tas_lock_t *m)
+{
+    while (m->f.test_and_set(std::memory_order_acquire))
+    {
+        LOCKSTAT_SPIN(); // spin
+    }
+}
+static inline void unlock(tas_lock_t *m)
+{
+    m->f.clear(std::memory_order_release);
+}
+
+/* test-and-test-and-set: spin on a plain load (line stays shared), only try the
+   exchange when the lock looks free, back off exponentially after a failed try */
+struct alignas(CACHE_LINE) ttas_lock_t
+{
+    std::atomic<int> locked{0};
+};
+static inline void init(ttas_lock_t *m)
+{
+    m->locked.store(0, std::memory_order_relaxed);
+}
+static inline void lock(ttas_lock_t *m)
+{
+    int backoff = BACKOFF_MIN;
+    unsigned spins = 0;
+    while (true)
+    {
+        while (m->locked.load(std::memory_order_relaxed))
+        {
+            spin_wait(&spins);
+        }
+        if (!m->locked.exchange(1, std::memory_order_acquire))
+        {
+            return;
+        }
+        for (int i = 0; i < backoff; i++)
+        {
+            spin_wait(&spins);
+        }
+        if (backoff < BACKOFF_MAX)
+        {
+            backoff <<= 1;
+        }
+    }
+}
+static inline void unlock(ttas_lock_t *m)
+{
+    m->locked.store(0, std::memory_order_release);
+}
+
+/* ticket lock: FIFO, one fetch_add per acquisition; waiters back off in proportion
+   to how far back in line they are */
+struct ticket_lock_t
+{
+    alignas(CACHE_LINE) std::atomic<unsigned> next{0};
+    alignas(CACHE_LINE) std::atomic<unsigned> serving{0};
+};
+static inline void init(ticket_lock_t *m)
+{
+    m->next.store(0, std::memory_order_relaxed);
+    m->serving.store(0, std::memory_order_relaxed);
+}
+static inline void lock(ticket_lock_t *m)
+{
+    unsigned me = m->next.fetch_add(1, std::memory_order_relaxed);
+    unsigned spins = 0;
+    while (true)
+    {
+        unsigned now = m->serving.load(std::memory_order_acquire);
+        if (now == me)
+        {
+            return;
+        }
+        for (unsigned i = 0; i < (me - now) * BACKOFF_MIN; i++)
+        {
+            spin_wait(&spins);
+        }
+    }
+}
+static inline void unlock(ticket_lock_t *m)
+{
+    m->serving.store(m->serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+/* MCS queue lock: waiters link into a queue and each spins on its own node, so a
+   release touches exactly one other thread's line. The node is thread_local, so a
+   thread can hold one MCS lock at a time. */
+struct alignas(CACHE_LINE) mcs_node_t
+{
+    std::atomic<mcs_node_t *> next{nullptr};
+    std::atomic<int> locked{0};
+};
+struct alignas(CACHE_LINE) mcs_lock_t
+{
+    std::atomic<mcs_node_t *> tail{nullptr};
+};
+static thread_local mcs_node_t mcs_self;
+
+static inline void init(mcs_lock_t *m)
+{
+    m->tail.store(nullptr, std::memory_order_relaxed);
+}
+static inline void lock(mcs_lock_t *m)
+{
+    mcs_node_t *me = &mcs_self;
+    me->next.store(nullptr, std::memory_order_relaxed);
+    me->locked.store(1, std::memory_order_relaxed);
+
+    mcs_node_t *prev = m->tail.exchange(me, std::memory_order_acq_rel);
+    if (prev)
+    {
+        prev->next.store(me, std::memory_order_release);
+        unsigned spins = 0;
+        while (me->locked.load(std::memory_order_acquire))
+        {
+            spin_wait(&spins);
+        }
+    }
+}
+static inline void unlock(mcs_lock_t *m)
+{
+    mcs_node_t *me = &mcs_self;
+    mcs_node_t *succ = me->next.load(std::memory_order_acquire);
+    if (!succ)
+    {
+        mcs_node_t *expected = me;
+        if (m->tail.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel))
+        {
+            return; // nobody waiting
+        }
+        // a successor is between its exchange and linking in
+        unsigned spins = 0;
+        while (!(succ = me->next.load(std::memory_order_acquire)))
+        {
+            spin_wait(&spins);
+        }
+    }
+    succ->locked.store(0, std::memory_order_release);
+}
+
+/* futex mutex (Drepper "Futexes are tricky", mutex #3):
+   0 = unlocked, 1 = locked, 2 = locked with waiters. Waiters sleep in the kernel
+   instead of spinning, unlock only makes a syscall when someone is asleep. */
+struct alignas(CACHE_LINE) futex_lock_t
+{
+    std::atomic<int> state{0};
+};
+static inline void futex_wait(std::atomic<int> *addr, int val)
+{
+    LOCKSTAT_SPIN();
+#ifdef __linux__
+    syscall(SYS_futex, (int *)addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+    (void)addr;
+    (void)val;
+    std::this_thread::yield();
+#endif
+}
+static inline void futex_wake_one(std::atomic<int> *addr)
+{
+#ifdef __linux__
+    syscall(SYS_futex, (int *)addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    (void)addr;
+#endif
+}
+static inline void init(futex_lock_t *m)
+{
+    m->state.store(0, std::memory_order_relaxed);
+}
+static inline void lock(futex_lock_t *m)
+{
+    int c = 0;
+    if (m->state.compare_exchange_strong(c, 1, std::memory_order_acquire))
+    {
+        return;
+    }
+    if (c != 2)
+    {
+        c = m->state.exchange(2, std::memory_order_acquire);
+    }
+    while (c != 0)
+    {
+        futex_wait(&m->state, 2);
+        c = m->state.exchange(2, std::memory_order_acquire);
+    }
+}
+static inline void unlock(futex_lock_t *m)
+{
+    if (m->state.fetch_sub(1, std::memory_order_release) != 1)
+    {
+        m->state.store(0, std::memory_order_release);
+        futex_wake_one(&m->state);
+    }
+}
+
+#endif
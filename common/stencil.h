@@ -0,0 +1,192 @@
+// stencil.h
+// compile-time stencils over 24-bit BGR rows (Asgn2 gaussian, Lab4 box blur, lab6 halo)
+//
+// A stencil is a type with constexpr tables:
+//
+//   struct Box3
+//   {
+//       static constexpr StencilTap taps[] = {{0, -1}, {0, 0}, {0, 1}}; // {dy, dx} in pixels
+//       static constexpr StencilGroup groups[] = {{1.0, 3}};            // {weight, taps}
+//       static constexpr int renormalize = 1;
+//   };
+//   stencil_row<Box3>(img, padding, out_row, y, width, height);
+//
+// Taps are summed group by group: the next `n` taps of a group are added as
+// integers, then acc += weight * sum. Give every tap its own group to keep a
+// tap-by-tap double sum (the gaussian), share a group when the formula adds the
+// neighbours first (the halo stencil); the result is the same as the hand-written
+// loop down to the last bit.
+//
+//   renormalize 1  taps outside the image are dropped and the sum is divided by the
+//                  weight that was used (the blurs)
+//   renormalize 0  every tap is read as is and nothing is divided; the caller owns
+//                  the ghost rows and what x -/+ reach reads (lab6)
+//
+// Interior pixels run a fully unrolled kernel with no bounds checks, over the bytes
+// of the row so the three channels share one loop; only the `reach` pixels at each
+// edge (and rows near the top / bottom) take the checked border kernel.
+
+#ifndef STENCIL_H
+#define STENCIL_H
+
+#include <stdint.h>
+
+struct StencilTap
+{
+    int dy, dx;
+};
+
+struct StencilGroup
+{
+    double w;
+    int n;
+};
+
+template <class S>
+constexpr int stencil_groups()
+{
+    return (int)(sizeof(S::groups) / sizeof(S::groups[0]));
+}
+
+// furthest tap in x (axis 0) or y (axis 1)
+template <class S>
+constexpr int stencil_reach(int axis)
+{
+    int r = 0;
+    for (const StencilTap &t : S::taps)
+    {
+        int d = (axis == 0) ? t.dx : t.dy;
+        d = (d < 0) ? -d : d;
+        r = (d > r) ? d : r;
+    }
+    return r;
+}
+
+// weight of all taps, added tap by tap like the border kernel does
+template <class S>
+constexpr double stencil_weight()
+{
+    double sum = 0.0;
+    for (const StencilGroup &g : S::groups)
+    {
+        for (int k = 0; k < g.n; k++)
+        {
+            sum += g.w;
+        }
+    }
+    return sum;
+}
+
+// integer sum of taps [T, T + N) around p
+template <class S, int T, int N>
+static inline int stencil_group_sum(const uint8_t *p, long stride)
+{
+    if constexpr (N == 0)
+    {
+        return 0;
+    }
+    else
+    {
+        constexpr StencilTap t = S::taps[T + N - 1];
+        return stencil_group_sum<S, T, N - 1>(p, stride) + p[t.dy * stride + t.dx * 3];
+    }
+}
+
+// acc + the groups from G on, every tap inside the image
+template <class S, int G, int T>
+static inline double stencil_sum_from(double acc, const uint8_t *p, long stride)
+{
+    if constexpr (G == stencil_groups<S>())
+    {
+        return acc;
+    }
+    else
+    {
+        constexpr StencilGroup g = S::groups[G];
+        acc += g.w * stencil_group_sum<S, T, g.n>(p, stride);
+        return stencil_sum_from<S, G + 1, T + g.n>(acc, p, stride);
+    }
+}
+
+// the first group starts the sum (no 0.0 + ..., which the compiler has to keep)
+template <class S>
+static inline double stencil_sum(const uint8_t *p, long stride)
+{
+    constexpr StencilGroup g = S::groups[0];
+    double acc = g.w * stencil_group_sum<S, 0, g.n>(p, stride);
+    return stencil_sum_from<S, 1, g.n>(acc, p, stride);
+}
+
+// one byte (channel c of pixel x, y) with every tap checked against the image
+template <class S>
+static inline uint8_t stencil_border(const uint8_t *src, long stride, int x, int y, int c, int width, int height)
+{
+    double acc = 0.0, used = 0.0;
+    int t = 0;
+    for (const StencilGroup &g : S::groups)
+    {
+        int s = 0;
+        for (int k = 0; k < g.n; k++, t++)
+        {
+            int nx = x + S::taps[t].dx, ny = y + S::taps[t].dy;
+            if (nx >= 0 && nx < width && ny >= 0 && ny < height)
+            {
+                s += src[ny * stride + nx * 3 + c];
+                used += g.w;
+            }
+        }
+        acc += g.w * s;
+    }
+    return (uint8_t)(acc / used);
+}
+
+// row y of the output: dst[0 .. width * 3) from src (row 0 of the image, rows
+// `stride` bytes apart). height is only used to renormalize.
+template <class S>
+static inline void stencil_row(const uint8_t *src, long stride, uint8_t *dst, int y, int width, int height)
+{
+    constexpr int rx = stencil_reach<S>(0), ry = stencil_reach<S>(1);
+    constexpr double total = stencil_weight<S>();
+    const uint8_t *row = src + y * stride;
+
+    int lo = 0, hi = width;
+    if constexpr (S::renormalize != 0)
+    {
+        if (y < ry || y >= height - ry)
+        {
+            lo = hi = width;
+        }
+        else
+        {
+            lo = (rx < width) ? rx : width;
+            hi = (width - rx > lo) ? width - rx : lo;
+        }
+        for (int x = 0; x < width; x++)
+        {
+            if (x == lo)
+            {
+                x = hi; // interior below
+                if (x >= width)
+                {
+                    break;
+                }
+            }
+            for (int c = 0; c < 3; c++)
+            {
+                dst[x * 3 + c] = stencil_border<S>(src, stride, x, y, c, width, height);
+            }
+        }
+    }
+
+    for (int j = lo * 3; j < hi * 3; j++)
+    {
+        double acc = stencil_sum<S>(row + j, stride);
+        if constexpr (S::renormalize != 0)
+        {
+            acc /= total;
+        }
+        dst[j] = (uint8_t)acc;
+    }
+}
+
+#endif
@@ -12,8 +12,12 @@
 #include <stdatomic.h>
 #include <thread>
 #include <math.h>
+#include <utility>
 #include <mpi.h> //mpiexec
 
+#include "../common/mpi_slab.h"
+#include "../common/stencil.h"
+
 #pragma pack(push, 1)
 struct BMPFileHeader
 {
@@ -49,10 +53,12 @@ struct BMPImage24
     int width = 0;
     int height = 0;
     int pre_height = 0;
+    long data_offset = 0; // file offset of the pixel data
     std::vector<uint8_t> bgr; // BGR data
 };
 
-static BMPImage24 load_bmp(const char *filename)
+// header_only: stop after the headers (pixels are read per rank with MPI-IO)
+static BMPImage24 load_bmp(const char *filename, int header_only)
 {
     FILE *file = fopen(filename, "rb");
     if (!file)
@@ -85,6 +91,14 @@ static BMPImage24 load_bmp(const char *filename)
     img.width = ih.biWidth;
     img.height = (ih.biHeight > 0) ? ih.biHeight : -ih.biHeight;
     img.pre_height = ih.biHeight;
+    img.data_offset = (long)fh.bfOffBits;
+
+    if (header_only)
+    {
+        fclose(file);
+        printf("BMP Header loaded: %dx%d\n", img.width, img.height);
+        return img;
+    }
 
     int padding = row_padded(img.width);
     int image_bytes = padding * img.height;
@@ -108,7 +122,37 @@ static BMPImage24 load_bmp(const char *filename)
     return img;
 }
 
-static void save_bmp(const char *filename, const BMPImage24 *img)
+// file + info header in front of the pixel data (54 bytes)
+struct BMPHeaders
+{
+    BMPFileHeader fh;
+    BMPInfoHeader ih;
+};
+
+static BMPHeaders make_bmp_headers(const BMPImage24 *img)
+{
+    int width = img->width;
+    int height = img->height;
+    int padding = row_padded(width);
+
+    BMPHeaders h;
+    memset(&h, 0, sizeof(h));
+    h.fh.bfType = 0x4D42;
+    h.fh.bfOffBits = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
+    h.fh.bfSize = h.fh.bfOffBits + (unsigned int)(padding * height);
+
+    h.ih.biSize = sizeof(BMPInfoHeader);
+    h.ih.biWidth = width;
+    h.ih.biHeight = img->pre_height;
+    h.ih.biPlanes = 1;
+    h.ih.biBitCount = 24;
+    h.ih.biCompression = 0;
+    h.ih.biSizeImage = (unsigned int)(padding * height);
+    return h;
+}
+
+// pixels: img->height rows of row_padded(width) bytes, e.g. a shared window
+static void save_bmp_pixels(const char *filename, const BMPImage24 *img, const uint8_t *pixels)
 {
     FILE *file = fopen(filename, "wb");
     if (!file)
@@ -121,32 +165,375 @@ static void save_bmp(const char *filename, const BMPImage24 *img)
         printf("Saving file: %s\n", filename);
     }
 
-    int width = img->width;
-    int height = img->height;
-    int padding = row_padded(width);
-
-    struct BMPFileHeader fh;
-    memset(&fh, 0, sizeof(fh));
-    fh.bfType = 0x4D42;
-    fh.bfOffBits = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
-    fh.bfSize = fh.bfOffBits + (unsigned int)(padding * height);
-
-    struct BMPInfoHeader ih;
-    memset(&ih, 0, sizeof(ih));
-    ih.biSize = sizeof(BMPInfoHeader);
-    ih.biWidth = width;
-    ih.biHeight = img->pre_height;
-    ih.biPlanes = 1;
-    ih.biBitCount = 24;
-    ih.biCompression = 0;
-    ih.biSizeImage = (unsigned int)(padding * height);
-
-    fwrite(&fh, sizeof(fh), 1, file);
-    fwrite(&ih, sizeof(ih), 1, file);
-    fwrite(img->bgr.data(), 1, img->bgr.size(), file);
+    BMPHeaders h = make_bmp_headers(img);
+    fwrite(&h.fh, sizeof(h.fh), 1, file);
+    fwrite(&h.ih, sizeof(h.ih), 1, file);
+    fwrite(pixels, 1, (size_t)row_padded(img->width) * img->height, file);
     fclose(file);
 }
 
+static void save_bmp(const char *filename, const BMPImage24 *img)
+{
+    save_bmp_pixels(filename, img, img->bgr.data());
+}
+
+// --flag anywhere after the positional arguments
+static int has_flag(int argc, char **argv, const char *flag)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], flag) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// --flag <int>, or def when absent
+static int flag_int(int argc, char **argv, const char *flag, int def)
+{
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], flag) == 0)
+        {
+            return atoi(argv[i + 1]);
+        }
+    }
+    return def;
+}
+
+// ghost rows of `buf` (nloc rows between `depth` ghost rows on each side) from the
+// neighbours, one message per direction whatever the depth
+static void halo_exchange(unsigned char *buf, int nloc, int padding, int top_neigh, int bot_neigh, int depth)
+{
+    int bytes = depth * padding;
+    // exchange to bottom ghost rows
+    MPI_Sendrecv(buf + bytes, bytes, MPI_UNSIGNED_CHAR, top_neigh, 0, buf + (size_t)(nloc + depth) * padding, bytes, MPI_UNSIGNED_CHAR, bot_neigh, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    // printf("exchange 1 pass\n");
+    // exchange to top ghost rows
+    MPI_Sendrecv(buf + (size_t)nloc * padding, bytes, MPI_UNSIGNED_CHAR, bot_neigh, 1, buf, bytes, MPI_UNSIGNED_CHAR, top_neigh, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    // printf("exchange 2 pass\n");
+}
+
+// non-blocking version: post both ghost-row receives and edge-row sends, the caller
+// computes interior rows and then waits on req[4]
+static void halo_post(unsigned char *buf, int nloc, int padding, int top_neigh, int bot_neigh, MPI_Request *req)
+{
+    MPI_Irecv(buf + (nloc + 1) * padding, padding, MPI_UNSIGNED_CHAR, bot_neigh, 0, MPI_COMM_WORLD, &req[0]);
+    MPI_Irecv(buf, padding, MPI_UNSIGNED_CHAR, top_neigh, 1, MPI_COMM_WORLD, &req[1]);
+    MPI_Isend(buf + padding, padding, MPI_UNSIGNED_CHAR, top_neigh, 0, MPI_COMM_WORLD, &req[2]);
+    MPI_Isend(buf + (nloc * padding), padding, MPI_UNSIGNED_CHAR, bot_neigh, 1, MPI_COMM_WORLD, &req[3]);
+}
+
+// stencil formula : new[y][x]=0.25⋅old[y][x]+0.1875⋅(old[y−1][x]+old[y+1][x]+old[y][x−1]+old[y][x+1])
+// the neighbours are added first, x -/+ 1 pixel reads straight into the next row's
+// bytes at the strip edge (no renormalizing)
+struct FivePoint
+{
+    static constexpr StencilTap taps[] = {{0, 0}, {1, 0}, {-1, 0}, {0, -1}, {0, 1}};
+    static constexpr StencilGroup groups[] = {{0.25, 1}, {0.1875, 4}};
+    static constexpr int renormalize = 0;
+};
+
+// stencil on rows [y0, y1] of old -> same rows of new (both with ghost rows at 0, nloc + 1)
+static void stencil_rows(const unsigned char *loc_old, unsigned char *loc_new, int y0, int y1, int width, int padding)
+{
+    for (int y = y0; y <= y1; y++){
+        stencil_row<FivePoint>(loc_old, padding, loc_new + (y * padding), y, width, 0);
+    }
+}
+
+// checksum of the nloc rows after the top ghost row, summed on rank 0
+static long long checksum(const unsigned char *buf, int nloc, int width, int padding)
+{
+    long long lsum = 0;
+    for (int i = 1; i <= nloc; i++){
+        for (int j = 0; j < width * 3; j++){
+            lsum += buf[i * padding + j];
+        }
+    }
+
+    long long gsum = 0;
+    MPI_Reduce(&lsum, &gsum, 1, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    return gsum;
+}
+
+// one rank's row strip: nloc rows between `depth` ghost rows on each side
+struct Strip
+{
+    int nloc, width, padding, depth;
+    int top, bot;     // neighbour ranks, MPI_PROC_NULL at the image edge
+    int blocking;     // depth 1: Sendrecv before the sweep instead of overlapping
+    ShmImage *win[2]; // --shm: windows behind buf[0] / buf[1], else null
+};
+
+// `steps` sweeps starting from buf[0] (a view with st->depth ghost rows); the result
+// ends up in buf[steps & 1]. With depth k > 1 the ghost zones are refreshed every k
+// steps and sweep j of a block updates the local rows plus k - 1 - j rows of each
+// ghost zone (redundant work on the neighbours' rows), rows outside the image stay 0.
+static void strip_steps(const Strip *st, unsigned char *buf[2], int steps, int check_every,
+                        double *t_exchange, double *t_stencil)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    int nloc = st->nloc, padding = st->padding, width = st->width, k = st->depth;
+    int cur = 0;
+    *t_exchange = *t_stencil = 0.0;
+
+    for (int step = 1; step <= steps;)
+    {
+        unsigned char *old = buf[cur];
+        double t0 = MPI_Wtime();
+        int kb = 1; // sweeps done on this exchange
+        if (k > 1)
+        {
+            kb = (steps - step + 1 < k) ? steps - step + 1 : k;
+            halo_exchange(old, nloc, padding, st->top, st->bot, k);
+            double t1 = MPI_Wtime();
+            for (int j = 0; j < kb; j++)
+            {
+                int lo = k - (kb - 1 - j), hi = k + nloc - 1 + (kb - 1 - j);
+                if (st->top == MPI_PROC_NULL)
+                    lo = k;
+                if (st->bot == MPI_PROC_NULL)
+                    hi = k + nloc - 1;
+                stencil_rows(buf[cur], buf[cur ^ 1], lo, hi, width, padding);
+                cur ^= 1;
+                if (check_every > 0 && (step + j) % check_every == 0 && step + j < steps)
+                {
+                    long long s = checksum(buf[cur] + (size_t)(k - 1) * padding, nloc, width, padding);
+                    if (rank == 0)
+                        printf("step %d: gsum=%lld\n", step + j, s);
+                }
+            }
+            *t_exchange += t1 - t0;
+            *t_stencil += MPI_Wtime() - t1;
+            step += kb;
+            continue;
+        }
+
+        unsigned char *nxt = buf[cur ^ 1];
+        if (st->win[0] || st->blocking)
+        {
+            if (!st->win[0])
+            {
+                halo_exchange(old, nloc, padding, st->top, st->bot, 1);
+            }
+            // if (rank == 1)
+            //     printf("rank 1 received %d from rank 0\n", loc_old[nloc * padding + (img.width / 2) * 3]);
+
+            double t1 = MPI_Wtime();
+            stencil_rows(old, nxt, 1, nloc, width, padding);
+            double t2 = MPI_Wtime();
+            if (st->win[0])
+            {
+                // neighbours' rows of the new image complete before anyone reads them
+                MPI_Win_fence(0, st->win[cur ^ 1]->win);
+            }
+            *t_exchange += (t1 - t0) + (MPI_Wtime() - t2);
+            *t_stencil += t2 - t1;
+        }
+        else
+        {
+            MPI_Request req[4];
+            halo_post(old, nloc, padding, st->top, st->bot, req);
+            double t1 = MPI_Wtime();
+            stencil_rows(old, nxt, 2, nloc - 1, width, padding);
+            double t2 = MPI_Wtime();
+            MPI_Waitall(4, req, MPI_STATUSES_IGNORE);
+            double t3 = MPI_Wtime();
+            // the two edge rows need the ghost rows (one row when nloc == 1)
+            stencil_rows(old, nxt, 1, 1, width, padding);
+            if (nloc > 1)
+            {
+                stencil_rows(old, nxt, nloc, nloc, width, padding);
+            }
+            double t4 = MPI_Wtime();
+            *t_exchange += (t1 - t0) + (t3 - t2); // exposed: posting + waiting
+            *t_stencil += (t2 - t1) + (t4 - t3);
+        }
+        cur ^= 1;
+
+        if (check_every > 0 && step % check_every == 0 && step < steps)
+        {
+            long long s = checksum(buf[cur], nloc, width, padding);
+            if (rank == 0)
+                printf("step %d: gsum=%lld\n", step, s);
+        }
+        step++;
+    }
+}
+
+// rows x row_bytes block, rows `stride` bytes apart (a pixel block of the image or
+// of a local buffer)
+static MPI_Datatype block_type(int rows, int row_bytes, int stride)
+{
+    MPI_Datatype t;
+    MPI_Type_vector(rows, row_bytes, stride, MPI_UNSIGNED_CHAR, &t);
+    MPI_Type_commit(&t);
+    return t;
+}
+
+// --2d: block decomposition on a Cartesian grid of ranks
+// Each rank owns ny x nx pixels plus a one-pixel ghost frame; rows are ls bytes.
+// Outside the image is zero on all four sides (the strip layout instead reads the
+// previous / next row's end pixel at the left / right border).
+struct Block2D
+{
+    MPI_Comm cart;
+    int dims[2];   // ranks along y, x
+    int coords[2];
+    int y0, ny;    // first image row, rows
+    int x0, nx;    // first image column (pixels), columns
+    int ls;        // local row stride in bytes, (nx + 2) * 3
+    int north, south, west, east;
+    MPI_Datatype column; // ny pixels down one column of a local buffer
+};
+
+static void block_setup(Block2D *b, int height, int width)
+{
+    int nprocs;
+    MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+    b->dims[0] = b->dims[1] = 0;
+    MPI_Dims_create(nprocs, 2, b->dims);
+    int periods[2] = {0, 0};
+    MPI_Cart_create(MPI_COMM_WORLD, 2, b->dims, periods, 0, &b->cart);
+
+    int crank;
+    MPI_Comm_rank(b->cart, &crank);
+    MPI_Cart_coords(b->cart, crank, 2, b->coords);
+    slab_rows(height, b->dims[0], b->coords[0], &b->y0, &b->ny);
+    slab_rows(width, b->dims[1], b->coords[1], &b->x0, &b->nx);
+    b->ls = (b->nx + 2) * 3;
+    MPI_Cart_shift(b->cart, 0, 1, &b->north, &b->south);
+    MPI_Cart_shift(b->cart, 1, 1, &b->west, &b->east);
+    b->column = block_type(b->ny, 3, b->ls);
+}
+
+// east / west columns first, then north / south rows including the ghost columns,
+// so the corner ghosts arrive with the rows
+static void block_exchange(const Block2D *b, unsigned char *buf)
+{
+    unsigned char *first = buf + b->ls;         // row 1
+    unsigned char *last = buf + b->ny * b->ls;  // row ny
+    MPI_Sendrecv(first + 3, 1, b->column, b->west, 2, first + (b->nx + 1) * 3, 1, b->column, b->east, 2, b->cart, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(first + b->nx * 3, 1, b->column, b->east, 3, first, 1, b->column, b->west, 3, b->cart, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(first, b->ls, MPI_UNSIGNED_CHAR, b->north, 0, last + b->ls, b->ls, MPI_UNSIGNED_CHAR, b->south, 0, b->cart, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(last, b->ls, MPI_UNSIGNED_CHAR, b->south, 1, buf, b->ls, MPI_UNSIGNED_CHAR, b->north, 1, b->cart, MPI_STATUS_IGNORE);
+}
+
+// same formula as stencil_rows, over the ny x nx interior of a ghost-framed block
+static void block_stencil(const Block2D *b, const unsigned char *old, unsigned char *neu)
+{
+    // pixels start after the west ghost column
+    for (int y = 1; y <= b->ny; y++){
+        stencil_row<FivePoint>(old + 3, b->ls, neu + (y * b->ls) + 3, y, b->nx, 0);
+    }
+}
+
+// rank 0 sends every block straight out of (or back into) the padded image with a
+// vector type, so nothing is packed by hand
+static void block_move(const Block2D *b, BMPImage24 *img, unsigned char *buf, int to_ranks)
+{
+    int rank, nprocs;
+    MPI_Comm_rank(b->cart, &rank);
+    MPI_Comm_size(b->cart, &nprocs);
+    int padding = row_padded(img->width);
+
+    MPI_Datatype mine = block_type(b->ny, b->nx * 3, b->ls);
+    MPI_Request req;
+    if (to_ranks)
+    {
+        MPI_Irecv(buf + b->ls + 3, 1, mine, 0, 4, b->cart, &req);
+    }
+    else
+    {
+        MPI_Isend(buf + b->ls + 3, 1, mine, 0, 5, b->cart, &req);
+    }
+
+    if (rank == 0)
+    {
+        for (int p = 0; p < nprocs; p++)
+        {
+            int c[2], y0, ny, x0, nx;
+            MPI_Cart_coords(b->cart, p, 2, c);
+            slab_rows(img->height, b->dims[0], c[0], &y0, &ny);
+            slab_rows(img->width, b->dims[1], c[1], &x0, &nx);
+            MPI_Datatype t = block_type(ny, nx * 3, padding);
+            unsigned char *at = img->bgr.data() + (size_t)y0 * padding + x0 * 3;
+            if (to_ranks)
+            {
+                MPI_Send(at, 1, t, p, 4, b->cart);
+            }
+            else
+            {
+                MPI_Recv(at, 1, t, p, 5, b->cart, MPI_STATUS_IGNORE);
+            }
+            MPI_Type_free(&t);
+        }
+    }
+    MPI_Wait(&req, MPI_STATUS_IGNORE);
+    MPI_Type_free(&mine);
+}
+
+static void run_2d(const char *output_bmp, BMPImage24 *img, int steps, int check_every)
+{
+    Block2D b;
+    block_setup(&b, img->height, img->width);
+    int rank;
+    MPI_Comm_rank(b.cart, &rank);
+
+    size_t bytes = (size_t)(b.ny + 2) * b.ls;
+    unsigned char *cur = (unsigned char *)calloc(bytes, 1);
+    unsigned char *nxt = (unsigned char *)calloc(bytes, 1);
+    block_move(&b, img, cur, 1);
+
+    double t_exchange = 0.0, t_stencil = 0.0;
+    for (int step = 1; step <= steps; step++)
+    {
+        double t0 = MPI_Wtime();
+        block_exchange(&b, cur);
+        double t1 = MPI_Wtime();
+        block_stencil(&b, cur, nxt);
+        t_exchange += t1 - t0;
+        t_stencil += MPI_Wtime() - t1;
+        std::swap(cur, nxt);
+
+        if (check_every > 0 && step % check_every == 0 && step < steps)
+        {
+            long long s = checksum(cur + 3, b.ny, b.nx, b.ls);
+            if (rank == 0)
+                printf("step %d: gsum=%lld\n", step, s);
+        }
+    }
+
+    long long gsum = checksum(cur + 3, b.ny, b.nx, b.ls);
+    block_move(&b, img, cur, 0);
+    if (rank == 0)
+    {
+        save_bmp(output_bmp, img);
+    }
+
+    // halo: ghost frame bytes received per step, against the bytes this rank updates
+    double halo = 2.0 * (b.nx + 2) * 3 + 2.0 * b.ny * 3;
+    double local[3] = {t_exchange, t_stencil, halo / ((double)b.nx * b.ny * 3)}, mx[3];
+    MPI_Reduce(local, mx, 3, MPI_DOUBLE, MPI_MAX, 0, b.cart);
+    if (rank == 0)
+    {
+        double updated = 2.0 * ((img->height + b.dims[0] - 1) / b.dims[0]) * ((img->width + b.dims[1] - 1) / b.dims[1]) * 3;
+        printf("2d grid %d x %d (block %d x %d px): halo/interior %.4f\n", b.dims[0], b.dims[1], b.ny, b.nx, mx[2]);
+        printf("%d steps (2d blocks): %.3f ms/step (exchange %.3f, stencil %.3f), stencil %.2f GB/s per rank\n", steps,
+               1e3 * (mx[0] + mx[1]) / steps, 1e3 * mx[0] / steps, 1e3 * mx[1] / steps, updated * steps / mx[1] / 1e9);
+        printf("gsum (checksum)=%lld\n", gsum);
+    }
+
+    free(cur);
+    free(nxt);
+    MPI_Type_free(&b.column);
+    MPI_Comm_free(&b.cart);
+}
+
 int main(int argc, char **argv)
 {
     MPI_Init(&argc, &argv);
@@ -156,7 +543,7 @@ int main(int argc, char **argv)
 
     if (argc < 3)
     {
-        printf("Usage: mpiexec -n 4 <n> ./halo.exe <input.bmp> <output.bmp>\n", argv[0]);
+        printf("Usage: mpiexec -n 4 <n> ./halo.exe <input.bmp> <output.bmp> [--mpiio | --shm | --2d] [--steps n] [--checksum every] [--blocking] [--depth k | --depth-scan]\n", argv[0]);
         MPI_Finalize();
         return 1;
     }
@@ -164,15 +551,73 @@ int main(int argc, char **argv)
     const char *input_bmp = argv[1];
     const char *output_bmp = argv[2];
 
-    BMPImage24 img = load_bmp(input_bmp);
-    int padding = row_padded(img.width);
+    // --mpiio: rank 0 reads only the headers, every rank reads / writes its own rows
+    int use_mpiio = has_flag(argc, argv, "--mpiio");
+
+    // --shm: old / new image live in shared windows, ranks read their neighbours'
+    // rows directly (no halo messages). Only when every rank is on this host.
+    int use_shm = has_flag(argc, argv, "--shm");
+    if (use_shm && !shm_single_node())
+    {
+        if (rank == 0)
+            printf("--shm: ranks span several nodes, using scatter/gather\n");
+        use_shm = 0;
+    }
+    if (use_shm)
+    {
+        use_mpiio = 0;
+    }
+
+    // --steps n: n sweeps, old / new swap roles (ping-pong) and only the ghost rows
+    // move between sweeps; --checksum k prints the global checksum every k steps
+    int steps = flag_int(argc, argv, "--steps", 1);
+    int check_every = flag_int(argc, argv, "--checksum", 0);
+
+    // ghost rows travel while interior rows 2..nloc-1 (which only read local rows)
+    // are computed; --blocking keeps the two MPI_Sendrecv before the sweep
+    int blocking = has_flag(argc, argv, "--blocking");
+
+    // --depth k: k ghost rows per side, one exchange per k steps (blocking);
+    // --depth-scan times k = 1, 2, 4, ... on this machine and runs with the best
+    int depth = flag_int(argc, argv, "--depth", 1);
+    int depth_scan = has_flag(argc, argv, "--depth-scan");
+
+    // --2d: blocks on an MPI_Cart_create grid instead of row strips (rank 0 reads
+    // and writes the file)
+    int use_2d = has_flag(argc, argv, "--2d");
+    if (use_2d)
+    {
+        use_mpiio = 0;
+        use_shm = 0;
+    }
+
+    BMPImage24 img;
+    if (!use_mpiio && !use_shm && !use_2d)
+    {
+        img = load_bmp(input_bmp, 0);
+    }
+    else if (rank == 0)
+    {
+        img = load_bmp(input_bmp, !use_2d);
+    }
 
     MPI_Bcast(&img.width, 1, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(&img.height, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&img.pre_height, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&img.data_offset, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+    int padding = row_padded(img.width);
+
+    if (use_2d)
+    {
+        run_2d(output_bmp, &img, steps, check_every);
+        MPI_Finalize();
+        return 0;
+    }
 
     const int N = img.height;
     int base = N / nprocs, rem = N % nprocs;
     int nloc = base + (rank < rem);
+    int start_row = rank * base + (rank < rem ? rank : rem);
 
     int *counts = 0, *displs = 0;
     if (rank == 0)
@@ -189,13 +634,64 @@ int main(int argc, char **argv)
         }
     }
 
-    // allocate mem for loc chunk and ghost row (top n bot)
-    int row_alloc = nloc + 2;
-    unsigned char *loc_old = (unsigned char *)malloc(row_alloc * padding);
-    unsigned char *loc_new = (unsigned char *)malloc(nloc * padding);
-    memset(loc_old, 0, row_alloc * padding);
+    // ghost rows may not reach past the nearest neighbour's strip
+    int max_depth = (N / nprocs < steps) ? N / nprocs : steps;
+    if (max_depth < 1)
+        max_depth = 1;
+    if (use_shm && (depth > 1 || depth_scan))
+    {
+        if (rank == 0)
+            printf("--shm has no halo messages, ignoring --depth\n");
+        depth = 1;
+        depth_scan = 0;
+    }
+    if (depth < 1 || depth > max_depth)
+    {
+        if (rank == 0)
+            printf("--depth %d out of range, using %d\n", depth, depth < 1 ? 1 : max_depth);
+        depth = (depth < 1) ? 1 : max_depth;
+    }
+    int alloc_depth = depth_scan ? max_depth : depth;
+
+    // allocate mem for loc chunk and ghost rows (top n bot), for both old and new
+    int row_alloc = nloc + 2 * alloc_depth;
+    unsigned char *loc_old, *loc_new;
+    ShmImage shm_old, shm_new;
+    if (use_shm)
+    {
+        // whole image framed by a zero row on each side: this rank's rows plus the
+        // neighbours' edge rows are then exactly the ghost-row layout used below
+        shm_alloc((MPI_Aint)(N + 2) * padding, &shm_old);
+        shm_alloc((MPI_Aint)(N + 2) * padding, &shm_new);
+        if (rank == 0)
+        {
+            memset(shm_old.base, 0, (size_t)(N + 2) * padding);
+            memset(shm_new.base, 0, (size_t)(N + 2) * padding);
+            read_pixels(input_bmp, img.data_offset, shm_old.base + padding, (size_t)N * padding);
+        }
+        MPI_Win_fence(0, shm_old.win);
+        MPI_Win_fence(0, shm_new.win);
+        loc_old = shm_old.base + (size_t)start_row * padding;
+        loc_new = shm_new.base + (size_t)start_row * padding;
+    }
+    else
+    {
+        loc_old = (unsigned char *)malloc(row_alloc * padding);
+        loc_new = (unsigned char *)malloc(row_alloc * padding);
+        memset(loc_old, 0, row_alloc * padding);
+        memset(loc_new, 0, row_alloc * padding);
+    }
+    // local rows start alloc_depth rows in
+    unsigned char *first_row = loc_old + (size_t)alloc_depth * padding;
 
-    MPI_Scatterv(img.bgr.data(), counts, displs, MPI_UNSIGNED_CHAR, loc_old + padding, nloc * padding, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+    if (use_mpiio)
+    {
+        mpiio_read_rows(input_bmp, img.data_offset, padding, start_row, nloc, first_row);
+    }
+    else if (!use_shm)
+    {
+        MPI_Scatterv(img.bgr.data(), counts, displs, MPI_UNSIGNED_CHAR, first_row, nloc * padding, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+    }
 
     // if (rank == 0) printf("rank 0 sending %d to rank 1\n", loc_old[nloc * padding + (img.width / 2) * 3]);
     
@@ -209,52 +705,118 @@ int main(int argc, char **argv)
         bot_neigh = MPI_PROC_NULL;
     }
 
-    // exchange to bottom ghost row
-    MPI_Sendrecv(loc_old + padding, padding, MPI_UNSIGNED_CHAR, top_neigh, 0, loc_old + (nloc + 1) * padding, padding, MPI_UNSIGNED_CHAR, bot_neigh, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    // printf("exchange 1 pass\n");
-    // exchange to top ghost row
-    MPI_Sendrecv(loc_old + (nloc * padding), padding, MPI_UNSIGNED_CHAR, bot_neigh, 1, loc_old, padding, MPI_UNSIGNED_CHAR, top_neigh, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    // printf("exchange 2 pass\n");
-
-    // if (rank == 1)
-    //     printf("rank 1 received %d from rank 0\n", loc_old[nloc * padding + (img.width / 2) * 3]);
-
-    // Stencil iteration 1
-    for (int y = 1; y <= nloc; y++){
-        for (int x = 0; x < img.width * 3; x++){
-            unsigned char* curr_row = loc_old + (y * padding);
-            unsigned char* up = loc_old + ((y + 1) * padding);
-            unsigned char* down = loc_old + ((y - 1) * padding);
-
-            // stencil formula : new[y][x]=0.25⋅old[y][x]+0.1875⋅(old[y−1][x]+old[y+1][x]+old[y][x−1]+old[y][x+1])
-            double center = curr_row[x];
-            double neighbors = up[x] + down[x] + curr_row[x - 3] + curr_row[x + 3];
-            double res = 0.25 * center + 0.1875 * neighbors;
-            
-            loc_new[(y - 1) * padding + x] = res;
+    Strip st;
+    st.nloc = nloc;
+    st.width = img.width;
+    st.padding = padding;
+    st.top = top_neigh;
+    st.bot = bot_neigh;
+    st.blocking = blocking;
+    st.win[0] = use_shm ? &shm_old : NULL;
+    st.win[1] = use_shm ? &shm_new : NULL;
+
+    if (depth_scan)
+    {
+        // every k starts from the same input; the rows sit at the same place for every
+        // k, a depth-k view just starts alloc_depth - k rows in
+        std::vector<unsigned char> input(first_row, first_row + (size_t)nloc * padding);
+        double best_time = 0.0;
+        if (rank == 0)
+            printf("%6s %12s %14s\n", "depth", "ms/step", "exchanges");
+        for (int k = 1; k <= max_depth; k *= 2)
+        {
+            memset(loc_old, 0, (size_t)row_alloc * padding);
+            memset(loc_new, 0, (size_t)row_alloc * padding);
+            memcpy(first_row, input.data(), input.size());
+
+            st.depth = k;
+            size_t skip = (size_t)(alloc_depth - k) * padding;
+            unsigned char *view[2] = {loc_old + skip, loc_new + skip};
+            double te, ts;
+            MPI_Barrier(MPI_COMM_WORLD);
+            strip_steps(&st, view, steps, 0, &te, &ts);
+            double t = te + ts, t_max;
+            MPI_Allreduce(&t, &t_max, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+            if (rank == 0)
+                printf("%6d %12.3f %14d\n", k, 1e3 * t_max / steps, (steps + k - 1) / k);
+            if (k == 1 || t_max < best_time)
+            {
+                best_time = t_max;
+                depth = k;
+            }
         }
+        if (rank == 0)
+            printf("best depth: %d (%d ranks, %d x %d image, %d steps)\n", depth, nprocs, img.width, N, steps);
+
+        memset(loc_old, 0, (size_t)row_alloc * padding);
+        memset(loc_new, 0, (size_t)row_alloc * padding);
+        memcpy(first_row, input.data(), input.size());
     }
 
+    st.depth = depth;
+    size_t skip = (size_t)(alloc_depth - depth) * padding;
+    unsigned char *view[2] = {loc_old + skip, loc_new + skip};
+    double t_exchange, t_stencil;
+    strip_steps(&st, view, steps, check_every, &t_exchange, &t_stencil);
+
+    // result rows, with one row above them for checksum()
+    unsigned char *cur = view[steps & 1] + (size_t)(depth - 1) * padding;
+    ShmImage *cur_win = (steps & 1) ? &shm_new : &shm_old;
+
     // checksum
-    long long lsum = 0;
-    for (int i = 0; i < nloc; i++){
-        for (int j = 0; j <img.width * 3; j++){
-            lsum += loc_new[i * padding + j];
+    long long gsum = checksum(cur, nloc, img.width, padding);
+
+    if (use_shm)
+    {
+        if (rank == 0)
+        {
+            save_bmp_pixels(output_bmp, &img, cur_win->base + padding);
+        }
+    }
+    else if (use_mpiio)
+    {
+        BMPHeaders h = make_bmp_headers(&img);
+        mpiio_write_rows(output_bmp, &h, (int)sizeof(h), N, padding, start_row, nloc, cur + padding);
+    }
+    else
+    {
+        MPI_Gatherv(cur + padding, nloc * padding, MPI_UNSIGNED_CHAR, img.bgr.data(), counts, displs, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+        if (rank == 0)
+        {
+            save_bmp(output_bmp, &img);
         }
     }
 
-    long long gsum = 0;
-    MPI_Reduce(&lsum, &gsum, 1, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
-
-    MPI_Gatherv(loc_new, nloc * padding, MPI_UNSIGNED_CHAR, img.bgr.data(), counts, displs, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+    // per step, slowest rank; stencil traffic = one read + one write of the local rows
+    double t_local[2] = {t_exchange, t_stencil}, t_max[2];
+    MPI_Reduce(t_local, t_max, 2, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (rank == 0)
+    {
+        double bytes = 2.0 * ((N + nprocs - 1) / nprocs) * img.width * 3;
+        // ghost rows received per step against the bytes updated, worst (thinnest) strip
+        printf("1d strips %d x 1 (strip %d x %d px): halo/interior %.4f\n", nprocs, N / nprocs, img.width, 2.0 / (N / nprocs));
+        if (depth > 1)
+            printf("depth %d: one exchange per %d steps\n", depth, depth);
+        printf("%d steps%s: %.3f ms/step (exchange %.3f, stencil %.3f), stencil %.2f GB/s per rank\n", steps,
+               use_shm ? " (shared window)" : ((blocking || depth > 1) ? " (blocking halo)" : " (overlapped halo)"),
+               1e3 * (t_max[0] + t_max[1]) / steps, 1e3 * t_max[0] / steps, 1e3 * t_max[1] / steps,
+               bytes * steps / t_max[1] / 1e9);
+    }
 
     if (rank == 0)
         printf("gsum (checksum)=%lld\n", gsum);
-    free(loc_old);
-    free(loc_new);
+    if (use_shm)
+    {
+        shm_free(&shm_old);
+        shm_free(&shm_new);
+    }
+    else
+    {
+        free(loc_old);
+        free(loc_new);
+    }
     if (rank == 0)
     {
-        save_bmp(output_bmp, &img);
         free(counts);
         free(displs);
     }